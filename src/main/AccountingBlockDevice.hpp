@@ -0,0 +1,233 @@
+#pragma once
+
+#include "BlockDevice.hpp"
+
+#include "util/ByteBuffer.hpp"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace akaifat {
+
+/*
+ * Wraps a device and records every read and write that passes through it: offset, length,
+ * direction, latency and whether it covers whole sectors. The aggregated metrics show how
+ * sequential the I/O is, how large the requests are, and how much a device that works in
+ * whole sectors has to transfer on top of what was asked for. Optionally the most recent
+ * requests are kept in a ring buffer.
+ */
+class AccountingBlockDevice : public BlockDevice {
+public:
+    enum class Direction {
+        Read,
+        Write
+    };
+
+    struct Request {
+        Direction direction;
+        std::int64_t offset;
+        std::int64_t length;
+        std::uint64_t latencyNs;
+        // Starts and ends on a sector boundary
+        bool aligned;
+    };
+
+    // Bucket i counts requests of up to 512 << i bytes that did not fit in bucket i - 1. The
+    // last bucket takes everything longer.
+    static constexpr std::size_t SIZE_BUCKET_COUNT = 16;
+
+    struct Metrics {
+        std::uint64_t reads = 0;
+        std::uint64_t writes = 0;
+        std::uint64_t readBytes = 0;
+        std::uint64_t writeBytes = 0;
+        // The requests rounded out to whole sectors
+        std::uint64_t sectorBytes = 0;
+        std::uint64_t unalignedRequests = 0;
+        // Sectors a write covers only partly, which a sector device has to read, patch and
+        // write back
+        std::uint64_t readModifyWrites = 0;
+        // Requests that start where the previous request in the same direction ended
+        std::uint64_t sequentialRequests = 0;
+        std::uint64_t readLatencyNs = 0;
+        std::uint64_t writeLatencyNs = 0;
+        std::uint64_t maxLatencyNs = 0;
+        std::array<std::uint64_t, SIZE_BUCKET_COUNT> sizeHistogram{};
+
+        std::uint64_t getRequestCount() const {
+            return reads + writes;
+        }
+
+        double getSequentialityRatio() const {
+            return getRequestCount() == 0 ? 0.0 : static_cast<double>(sequentialRequests) / getRequestCount();
+        }
+
+        // Sector bytes per requested byte, 1 when every request is aligned
+        double getAmplification() const {
+            const auto requested = readBytes + writeBytes;
+            return requested == 0 ? 1.0 : static_cast<double>(sectorBytes) / requested;
+        }
+    };
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    std::shared_ptr<BlockDevice> device;
+    const std::int64_t sectorSize;
+
+    std::mutex mutex;
+    Metrics metrics;
+    std::int64_t lastReadEnd = -1;
+    std::int64_t lastWriteEnd = -1;
+    std::vector<Request> recent;
+    std::size_t recentCapacity;
+    std::size_t recentNext = 0;
+
+    void record(Direction direction, std::int64_t offset, std::int64_t length, Clock::time_point start) {
+        const auto latencyNs = static_cast<std::uint64_t>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count());
+
+        const auto end = offset + length;
+        const auto sectorStart = offset / sectorSize * sectorSize;
+        const auto sectorEnd = (end + sectorSize - 1) / sectorSize * sectorSize;
+        const bool aligned = sectorStart == offset && sectorEnd == end;
+
+        std::size_t bucket = 0;
+
+        while (bucket < SIZE_BUCKET_COUNT - 1 && (std::int64_t{512} << bucket) < length)
+            bucket++;
+
+        std::lock_guard<std::mutex> guard(mutex);
+        auto &lastEnd = direction == Direction::Read ? lastReadEnd : lastWriteEnd;
+
+        if (direction == Direction::Read) {
+            metrics.reads++;
+            metrics.readBytes += length;
+            metrics.readLatencyNs += latencyNs;
+        } else {
+            metrics.writes++;
+            metrics.writeBytes += length;
+            metrics.writeLatencyNs += latencyNs;
+
+            if (length > 0) {
+                if (offset != sectorStart) metrics.readModifyWrites++;
+
+                // A write within one sector only counts that sector once
+                if (end != sectorEnd && (offset == sectorStart || sectorEnd - sectorStart > sectorSize))
+                    metrics.readModifyWrites++;
+            }
+        }
+
+        metrics.sectorBytes += sectorEnd - sectorStart;
+        metrics.maxLatencyNs = std::max(metrics.maxLatencyNs, latencyNs);
+        metrics.sizeHistogram[bucket]++;
+
+        if (!aligned) metrics.unalignedRequests++;
+
+        if (offset == lastEnd) metrics.sequentialRequests++;
+
+        lastEnd = end;
+
+        if (recentCapacity == 0) return;
+
+        const Request request{direction, offset, length, latencyNs, aligned};
+
+        if (recent.size() < recentCapacity) {
+            recent.push_back(request);
+        } else {
+            recent[recentNext] = request;
+        }
+
+        recentNext = (recentNext + 1) % recentCapacity;
+    }
+
+public:
+    // Keeps the last recentCapacity requests, none if it is 0
+    explicit AccountingBlockDevice(std::shared_ptr<BlockDevice> _device, std::size_t _recentCapacity = 0)
+    : device(std::move(_device)), sectorSize(device->getSectorSize()), recentCapacity(_recentCapacity) {
+        recent.reserve(recentCapacity);
+    }
+
+    Metrics getMetrics() {
+        std::lock_guard<std::mutex> guard(mutex);
+        return metrics;
+    }
+
+    // Oldest first
+    std::vector<Request> getRecentRequests() {
+        std::lock_guard<std::mutex> guard(mutex);
+
+        if (recent.size() < recentCapacity) return recent;
+
+        std::vector<Request> result(recent.begin() + recentNext, recent.end());
+        result.insert(result.end(), recent.begin(), recent.begin() + recentNext);
+        return result;
+    }
+
+    void reset() {
+        std::lock_guard<std::mutex> guard(mutex);
+        metrics = Metrics();
+        lastReadEnd = -1;
+        lastWriteEnd = -1;
+        recent.clear();
+        recentNext = 0;
+    }
+
+    std::int64_t getSize() override { return device->getSize(); }
+
+    void read(std::int64_t devOffset, ByteBuffer& dest) override {
+        const auto length = dest.remaining();
+        const auto start = Clock::now();
+        device->read(devOffset, dest);
+        record(Direction::Read, devOffset, length, start);
+    }
+
+    void write(std::int64_t devOffset, ByteBuffer& src) override {
+        const auto length = src.remaining();
+        const auto start = Clock::now();
+        device->write(devOffset, src);
+        record(Direction::Write, devOffset, length, start);
+    }
+
+    void read(std::int64_t devOffset, char* dest, std::int64_t length) override {
+        const auto start = Clock::now();
+        device->read(devOffset, dest, length);
+        record(Direction::Read, devOffset, length, start);
+    }
+
+    void write(std::int64_t devOffset, const char* src, std::int64_t length) override {
+        const auto start = Clock::now();
+        device->write(devOffset, src, length);
+        record(Direction::Write, devOffset, length, start);
+    }
+
+    void willNeed(std::int64_t devOffset, std::int64_t length) override { device->willNeed(devOffset, length); }
+
+    // Reads through the mapping bypass the accounting
+    const char* getMappedData(std::int64_t devOffset) override { return device->getMappedData(devOffset); }
+
+    std::shared_ptr<const char> getMapping() override { return device->getMapping(); }
+
+    int getFileDescriptor() override { return device->getFileDescriptor(); }
+
+    void flush() override { device->flush(); }
+
+    void sync() override { device->sync(); }
+
+    bool canSync() override { return device->canSync(); }
+
+    std::int32_t getSectorSize() override { return device->getSectorSize(); }
+
+    void close() override { device->close(); }
+
+    bool isClosed() override { return device->isClosed(); }
+
+    bool isReadOnly() override { return device->isReadOnly(); }
+};
+}
@@ -1,20 +1,62 @@
 #pragma once
 
+#include <algorithm>
 #include <cstdint>
+#include <memory>
 
 #include "util/ByteBuffer.hpp"
 
 namespace akaifat {
 class BlockDevice {
 public:
+    virtual ~BlockDevice() = default;
+
     virtual std::int64_t getSize() = 0;
 
     virtual void read(std::int64_t devOffset, ByteBuffer& dest) = 0;
 
     virtual void write(std::int64_t devOffset, ByteBuffer& src) = 0;
+
+    // Transfer straight from/to caller memory. The defaults go through a temporary ByteBuffer;
+    // devices that can do better override them.
+    virtual void read(std::int64_t devOffset, char* dest, std::int64_t length) {
+        ByteBuffer bb(length);
+        read(devOffset, bb);
+        std::copy(bb.getBuffer().begin(), bb.getBuffer().begin() + length, dest);
+    }
+
+    virtual void write(std::int64_t devOffset, const char* src, std::int64_t length) {
+        ByteBuffer bb(length);
+        bb.put(src, length);
+        bb.flip();
+        write(devOffset, bb);
+    }
             
+    // Hint that the range will be read soon. Devices that can start fetching it in the
+    // background may do so; the default ignores it.
+    virtual void willNeed(std::int64_t /*devOffset*/, std::int64_t /*length*/) {}
+
+    // Devices that keep the whole medium in memory return the address of devOffset, which stays
+    // valid until the device is closed. Others return nullptr.
+    virtual const char* getMappedData(std::int64_t /*devOffset*/) { return nullptr; }
+
+    // The whole medium, for devices that keep it in memory; nullptr for others. The memory
+    // stays valid for as long as the returned pointer is held, even after the device is closed.
+    virtual std::shared_ptr<const char> getMapping() { return nullptr; }
+
+    // Descriptor of the host file behind the device, for transfers the kernel can do on its
+    // own. -1 when there is none.
+    virtual int getFileDescriptor() { return -1; }
+
     virtual void flush() = 0;
 
+    // Makes everything written so far durable, e.g. with fdatasync. Devices that cannot
+    // sync only flush.
+    virtual void sync() { flush(); }
+
+    // True if sync() makes writes durable rather than only flushing them
+    virtual bool canSync() { return false; }
+
     virtual std::int32_t getSectorSize() = 0;
 
     virtual void close() = 0;
@@ -15,6 +15,10 @@ public:
     virtual void read(std::int64_t offset, ByteBuffer& dest) = 0;
 
     virtual void write(std::int64_t offset, ByteBuffer& src) = 0;
+
+    virtual void read(std::int64_t offset, char* dest, std::int64_t length) = 0;
+
+    virtual void write(std::int64_t offset, const char* src, std::int64_t length) = 0;
             
     virtual void flush() = 0;
 };
@@ -4,18 +4,66 @@
 
 #include "util/ByteBuffer.hpp"
 
+#include <algorithm>
 #include <exception>
 #include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+
+#if defined (__linux__) || defined (__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 namespace akaifat {
 class ImageBlockDevice : public BlockDevice {
 private:
     std::fstream& img;
     std::int64_t mediaSize = -1;
-    
+    // The fstream has one position for reads and writes alike, so every access that seeks
+    // holds this until it is done
+    std::recursive_mutex ioMutex;
+    // The fstream does not expose its descriptor, so sync() uses one of its own
+    int syncFd = -1;
+
+    // Image files are not always a whole number of sectors long
+    void readSector(std::int64_t sectorOffset, char* sector) {
+        const auto size = std::min<std::int64_t>(512, getSize() - sectorOffset);
+        img.seekg(sectorOffset, std::ios::beg);
+        img.read(sector, size);
+        std::fill(sector + size, sector + 512, 0);
+    }
+
+    void writeSector(std::int64_t sectorOffset, const char* sector) {
+        const auto size = std::min<std::int64_t>(512, getSize() - sectorOffset);
+        img.seekp(sectorOffset, std::ios::beg);
+        img.write(sector, size);
+    }
+
 public:
     explicit ImageBlockDevice(std::fstream& _img) : img (_img) {}
     explicit ImageBlockDevice(std::fstream& _img, uint64_t _mediaSize) : img (_img), mediaSize (static_cast<std::int64_t>(_mediaSize)) {}
+
+    // With the path of the image file, sync() makes writes durable instead of only flushing
+    // the stream, see canSync()
+    ImageBlockDevice(std::fstream& _img, uint64_t _mediaSize, const std::string& path)
+    : ImageBlockDevice(_img, _mediaSize) {
+#if defined (__linux__) || defined (__APPLE__)
+        syncFd = ::open(path.c_str(), O_RDONLY);
+
+        if (syncFd < 0) throw std::runtime_error("cannot open " + path);
+#endif
+    }
+
+    ImageBlockDevice(const ImageBlockDevice&) = delete;
+    ImageBlockDevice& operator=(const ImageBlockDevice&) = delete;
+
+    ~ImageBlockDevice() override {
+#if defined (__linux__) || defined (__APPLE__)
+        if (syncFd >= 0) ::close(syncFd);
+#endif
+    }
     
     bool isClosed() override { return false; }
 
@@ -24,6 +72,8 @@ public:
         if (mediaSize != -1) {
             return mediaSize;
         }
+
+        std::lock_guard<std::recursive_mutex> guard(ioMutex);
         
         img.seekg(0);
         const auto begin = img.tellg();
@@ -34,97 +84,120 @@ public:
     }
 
     void read(std::int64_t devOffset, ByteBuffer& dest) override {
+        const auto length = dest.remaining();
+        read(devOffset, dest.getBuffer().data() + dest.position(), length);
+        dest.position(dest.position() + length);
+    }
+
+    void write(std::int64_t devOffset, ByteBuffer& src) override {
+        const auto length = src.remaining();
+        write(devOffset, src.getBuffer().data() + src.position(), length);
+        src.position(src.position() + length);
+    }
+
+    // Reads straight into dest. Only a partial first sector goes through a bounce buffer.
+    void read(std::int64_t devOffset, char* dest, std::int64_t length) override {
         if (isClosed()) throw std::runtime_error("device closed");
-        
-        auto toReadTotal = dest.remaining();
 
-        if ((devOffset + toReadTotal) > getSize())
+        std::lock_guard<std::recursive_mutex> guard(ioMutex);
+
+        if ((devOffset + length) > getSize())
             throw std::runtime_error("reading past end of device");
-        
-        if (devOffset % 512 != 0)
+
+        if (length == 0) return;
+
+        const auto offsetWithinSector = devOffset % 512;
+
+        if (offsetWithinSector != 0)
         {
-            auto offsetWithinSector = devOffset % 512;
-            auto sectorOffset = devOffset - offsetWithinSector;
-            img.seekg(sectorOffset);
-            auto toReadWithStartAlignment = offsetWithinSector + toReadTotal;
-
-            if (toReadWithStartAlignment % 512 != 0)
-            {
-                auto toReadWithEndAlignment = toReadWithStartAlignment + (512 - (toReadWithStartAlignment % 512));
-                if ((sectorOffset + toReadWithEndAlignment) > getSize())
-                    throw std::runtime_error("reading past end of device");
-
-                ByteBuffer bb(toReadWithEndAlignment);
-                std::vector<char>& buf = bb.getBuffer();
-                img.read(&buf[0], toReadWithEndAlignment);
-                bb.flip();
-                for (std::int32_t i = offsetWithinSector; i < toReadWithStartAlignment; i++)
-                    dest.put(buf[i]);
-            }
-            else
-            {
-                ByteBuffer bb(toReadWithStartAlignment);
-                std::vector<char>& buf = bb.getBuffer();
-                img.read(&buf[0], toReadWithStartAlignment);
-                bb.flip();
-                for (std::int32_t i = offsetWithinSector; i < toReadWithStartAlignment; i++)
-                    dest.put(buf[i]);
-            }
-            return;
+            char sector[512];
+            const auto sectorOffset = devOffset - offsetWithinSector;
+            const auto size = std::min<std::int64_t>(512 - offsetWithinSector, length);
+
+            readSector(sectorOffset, sector);
+            std::copy(sector + offsetWithinSector, sector + offsetWithinSector + size, dest);
+
+            dest += size;
+            devOffset += size;
+            length -= size;
+
+            if (length == 0) return;
         }
 
         img.seekg(devOffset, std::ios::beg);
-        std::vector<char>& buf = dest.getBuffer();
-
-        auto toRead = dest.limit() - dest.position();
-        img.read(&buf[0] + dest.position(), toRead);
-        dest.position(dest.position() + toRead);
+        img.read(dest, length);
     }
 
-    void write(std::int64_t devOffset, ByteBuffer& src) override {
+    // Writes whole sectors straight from src. Only a partial first or last sector is
+    // read, patched and written back.
+    void write(std::int64_t devOffset, const char* src, std::int64_t length) override {
         if (isClosed()) throw std::runtime_error("device closed");
-        
-        const auto remaining = src.remaining();
+
+        std::lock_guard<std::recursive_mutex> guard(ioMutex);
+
+        if ((devOffset + length) > getSize()) throw std::runtime_error("writing past end of device");
+
+        if (length == 0) return;
 
         const auto offsetWithinSector = devOffset % 512;
-        const auto sectorOffset = devOffset - offsetWithinSector;
-        
-        if ((sectorOffset + remaining) > getSize()) throw std::runtime_error("writing past end of device");
-                
-        auto toWrite = offsetWithinSector + remaining;
-        const auto appendSize = 512 - (toWrite % 512);
-        toWrite += appendSize;
-
-        ByteBuffer prepend(512);
-        read(sectorOffset, prepend);
-        prepend.flip();
-        
-        ByteBuffer append(512);
-        read( (sectorOffset + toWrite) - 512, append);
-        append.flip();
-        
-        ByteBuffer data(toWrite);
-                
-        for (std::int32_t i = 0; i < toWrite; i++)
+
+        if (offsetWithinSector != 0 || length < 512)
         {
-            if (i < offsetWithinSector) {
-                data.put(prepend.get());
-            } else if ( (i - offsetWithinSector) < remaining) {
-                data.put(src.get());
-            } else {
-                data.put(append.get());
-            }
+            char sector[512];
+            const auto sectorOffset = devOffset - offsetWithinSector;
+            const auto size = std::min<std::int64_t>(512 - offsetWithinSector, length);
+
+            readSector(sectorOffset, sector);
+            std::copy(src, src + size, sector + offsetWithinSector);
+            writeSector(sectorOffset, sector);
+
+            src += size;
+            devOffset += size;
+            length -= size;
+        }
+
+        const auto wholeSectors = length - (length % 512);
+
+        if (wholeSectors > 0)
+        {
+            img.seekp(devOffset, std::ios::beg);
+            img.write(src, wholeSectors);
+
+            src += wholeSectors;
+            devOffset += wholeSectors;
+            length -= wholeSectors;
+        }
+
+        if (length > 0)
+        {
+            char sector[512];
+            readSector(devOffset, sector);
+            std::copy(src, src + length, sector);
+            writeSector(devOffset, sector);
         }
-        
-        img.seekp(sectorOffset, std::ios::beg);
-        auto& buf = data.getBuffer();
-        img.write(&buf[0], toWrite);
     }
             
     void flush() override {
+        std::lock_guard<std::recursive_mutex> guard(ioMutex);
         img.flush();
     }
 
+    void sync() override {
+        flush();
+
+#if defined (__linux__)
+        if (syncFd >= 0 && ::fdatasync(syncFd) != 0)
+            throw std::runtime_error("fdatasync failed");
+#elif defined (__APPLE__)
+        if (syncFd >= 0 && ::fsync(syncFd) != 0)
+            throw std::runtime_error("fsync failed");
+#endif
+    }
+
+    bool canSync() override {
+        return syncFd >= 0;
+    }
+
     std::int32_t getSectorSize() override {
         return 512;
     }
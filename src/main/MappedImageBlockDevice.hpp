@@ -0,0 +1,189 @@
+#pragma once
+
+#if defined (__linux__) || defined (__APPLE__)
+
+#include "BlockDevice.hpp"
+
+#include "util/ByteBuffer.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace akaifat {
+
+// Image file mapped into memory. Reads and writes are plain copies from and to the mapping,
+// and getMappedData() and getMapping() hand out the mapping itself. The image is unmapped
+// when the device is closed and nothing obtained from getMapping() is held anymore.
+class MappedImageBlockDevice : public BlockDevice {
+private:
+    int fd = -1;
+    std::shared_ptr<char> mapping;
+    char* base = nullptr;
+    std::int64_t size = 0;
+    bool readOnly;
+
+    static std::runtime_error error(const std::string& what, const std::string& path) {
+        return std::runtime_error(what + " " + path + ": " + std::strerror(errno));
+    }
+
+    void checkRange(std::int64_t devOffset, std::int64_t length) {
+        if (isClosed()) throw std::runtime_error("device closed");
+
+        if (devOffset < 0 || length < 0 || devOffset + length > size)
+            throw std::runtime_error("access past end of device");
+    }
+
+public:
+    explicit MappedImageBlockDevice(const std::string& path, bool _readOnly = false) : readOnly(_readOnly) {
+        fd = ::open(path.c_str(), readOnly ? O_RDONLY : O_RDWR);
+
+        if (fd < 0) throw error("cannot open", path);
+
+        struct stat st{};
+
+        if (::fstat(fd, &st) != 0) {
+            ::close(fd);
+            throw error("cannot stat", path);
+        }
+
+        size = st.st_size;
+
+        if (size == 0) {
+            ::close(fd);
+            throw std::runtime_error("cannot map empty image " + path);
+        }
+
+        auto address = ::mmap(nullptr, size, readOnly ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+        if (address == MAP_FAILED) {
+            ::close(fd);
+            throw error("cannot map", path);
+        }
+
+        const auto mappedSize = size;
+        mapping = std::shared_ptr<char>(static_cast<char*>(address), [mappedSize](char* p) {
+            ::munmap(p, mappedSize);
+        });
+        base = mapping.get();
+    }
+
+    MappedImageBlockDevice(const MappedImageBlockDevice&) = delete;
+    MappedImageBlockDevice& operator=(const MappedImageBlockDevice&) = delete;
+
+    ~MappedImageBlockDevice() override {
+        close();
+    }
+
+    std::int64_t getSize() override {
+        return size;
+    }
+
+    void read(std::int64_t devOffset, ByteBuffer& dest) override {
+        const auto length = dest.remaining();
+        read(devOffset, dest.getBuffer().data() + dest.position(), length);
+        dest.position(dest.position() + length);
+    }
+
+    void write(std::int64_t devOffset, ByteBuffer& src) override {
+        const auto length = src.remaining();
+        write(devOffset, src.getBuffer().data() + src.position(), length);
+        src.position(src.position() + length);
+    }
+
+    void read(std::int64_t devOffset, char* dest, std::int64_t length) override {
+        checkRange(devOffset, length);
+        std::copy_n(base + devOffset, length, dest);
+    }
+
+    void write(std::int64_t devOffset, const char* src, std::int64_t length) override {
+        checkRange(devOffset, length);
+
+        if (readOnly) throw std::runtime_error("device is read only");
+
+        std::copy_n(src, length, base + devOffset);
+    }
+
+    void willNeed(std::int64_t devOffset, std::int64_t length) override {
+        if (isClosed() || length <= 0) return;
+
+        const auto pageSize = static_cast<std::int64_t>(::sysconf(_SC_PAGESIZE));
+        const auto start = devOffset - (devOffset % pageSize);
+        const auto end = std::min(devOffset + length, size);
+
+        if (end > start)
+            ::madvise(base + start, end - start, MADV_WILLNEED);
+    }
+
+    const char* getMappedData(std::int64_t devOffset) override {
+        checkRange(devOffset, 0);
+        return base + devOffset;
+    }
+
+    std::shared_ptr<const char> getMapping() override {
+        return mapping;
+    }
+
+    int getFileDescriptor() override {
+        return fd;
+    }
+
+    void flush() override {
+        if (isClosed() || readOnly) return;
+
+        if (::msync(base, size, MS_SYNC) != 0)
+            throw std::runtime_error(std::string("msync failed: ") + std::strerror(errno));
+    }
+
+    void sync() override {
+        flush();
+
+        if (isClosed() || readOnly) return;
+
+#if defined (__linux__)
+        if (::fdatasync(fd) != 0)
+#else
+        if (::fsync(fd) != 0)
+#endif
+            throw std::runtime_error(std::string("sync failed: ") + std::strerror(errno));
+    }
+
+    bool canSync() override {
+        return !isClosed() && !readOnly;
+    }
+
+    std::int32_t getSectorSize() override {
+        return 512;
+    }
+
+    // Pointers from getMappedData() are invalid afterwards. The image stays mapped while
+    // pointers from getMapping() are held.
+    void close() override {
+        if (isClosed()) return;
+
+        mapping.reset();
+        ::close(fd);
+
+        base = nullptr;
+        fd = -1;
+    }
+
+    bool isClosed() override {
+        return base == nullptr;
+    }
+
+    bool isReadOnly() override {
+        return readOnly;
+    }
+};
+}
+
+#endif
@@ -3,6 +3,8 @@
 #include "FatDirectoryEntry.hpp"
 #include "ClusterChainDirectory.hpp"
 
+#include "../util/Trace.hpp"
+
 using namespace akaifat::fat;
 
 AbstractDirectory::AbstractDirectory(std::int32_t _capacity, bool _readOnly, bool _root)
@@ -31,8 +33,12 @@ void AbstractDirectory::read() {
     read(data);
     data.flip();
 
+    parse(data);
+}
+
+void AbstractDirectory::parse(ByteBuffer &data) {
     for (std::int32_t i = 0; i < capacity; i++) {
-        auto e = FatDirectoryEntry::read(data, readOnly);
+        auto e = FatDirectoryEntry::read(data, readOnly, entryPool);
 
         if (e == nullptr) continue;
 
@@ -68,6 +74,8 @@ int AbstractDirectory::getSize() {
 }
 
 void AbstractDirectory::flush() {
+    util::TraceScope trace("AbstractDirectory::flush");
+
     ByteBuffer data(capacity *FatDirectoryEntry::SIZE
     +(volumeLabel.length() != 0 ? FatDirectoryEntry::SIZE : 0));
 
@@ -142,6 +150,10 @@ std::shared_ptr<FatDirectoryEntry> AbstractDirectory::createSub(Fat *fat) {
     return entry;
 }
 
+std::shared_ptr<akaifat::util::BlockPool> AbstractDirectory::getEntryPool() {
+    return entryPool;
+}
+
 void AbstractDirectory::setLabel(std::string &label) {
     checkRoot();
 
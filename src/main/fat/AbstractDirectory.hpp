@@ -1,6 +1,7 @@
 #pragma once
 
 #include "../util/ByteBuffer.hpp"
+#include "../util/BlockPool.hpp"
 
 #include <memory>
 #include <vector>
@@ -39,6 +40,9 @@ namespace akaifat::fat {
 
         std::shared_ptr<FatDirectoryEntry> createSub(Fat *fat);
 
+        // Entries parsed from or created for this directory are allocated from this pool
+        std::shared_ptr<util::BlockPool> getEntryPool();
+
         void setLabel(std::string &label);
 
         virtual void changeSize(std::int32_t entryCount) = 0;
@@ -50,6 +54,7 @@ namespace akaifat::fat {
 
         std::int32_t capacity;
         std::string volumeLabel;
+        std::shared_ptr<util::BlockPool> entryPool = std::make_shared<util::BlockPool>();
 
         void checkRoot() const;
 
@@ -66,5 +71,8 @@ namespace akaifat::fat {
 
         virtual void read();
 
+        // Parses directory slots that were already read from the device
+        void parse(ByteBuffer &data);
+
     };
 }
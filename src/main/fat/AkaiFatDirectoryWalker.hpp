@@ -0,0 +1,172 @@
+#pragma once
+
+#include "AkaiFatLfnDirectory.hpp"
+#include "AkaiFatLfnDirectoryEntry.hpp"
+#include "ClusterChainDirectory.hpp"
+
+#include "../util/ThreadPool.hpp"
+
+#include <algorithm>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace akaifat::fat {
+
+/*
+ * Walks a directory tree depth-first. Before the entries of a directory are visited, the
+ * cluster chains of all its subdirectories that are not cached yet are read in on-disk order,
+ * so the device sees one ordered sweep per directory instead of one seek per descent.
+ * With a thread count > 0, parsing the prefetched directories runs on a thread pool while the
+ * visitor is busy with their siblings. Device I/O stays on the calling thread.
+ *
+ * A pre-visitor may skip subdirectories, so with one set nothing is prefetched: each
+ * subdirectory is read when the pre-visitor has accepted it.
+ *
+ * The file system lock is held shared for the whole walk, so the visitors must not
+ * modify the file system. Each directory's entries are collected under its own lock;
+ * changes other threads make to a directory after that are not visited.
+ */
+class AkaiFatDirectoryWalker {
+public:
+    using Entry = std::shared_ptr<AkaiFatLfnDirectoryEntry>;
+
+    // Return false to skip the children of a directory
+    using PreVisitor = std::function<bool(const Entry &entry, const std::string &path, std::int32_t depth)>;
+
+    using PostVisitor = std::function<void(const Entry &entry, const std::string &path, std::int32_t depth)>;
+
+    // Entries for which the filter returns false are neither visited nor descended into
+    using Filter = std::function<bool(const Entry &entry, const std::string &path)>;
+
+private:
+    PreVisitor preVisitor;
+    PostVisitor postVisitor;
+    Filter filter;
+    std::size_t threadCount = 0;
+    std::unique_ptr<util::ThreadPool> pool;
+
+    using PendingDirectories = std::map<std::shared_ptr<FatDirectoryEntry>, std::future<std::shared_ptr<AkaiFatLfnDirectory>>>;
+
+    static std::shared_ptr<AkaiFatLfnDirectory> parse(const std::shared_ptr<ClusterChainDirectory> &storage,
+                                                      ByteBuffer &data,
+                                                      const std::shared_ptr<Fat> &fat, bool readOnly) {
+        storage->parse(data);
+        auto result = std::make_shared<AkaiFatLfnDirectory>(storage, fat, readOnly);
+        result->parseLfn();
+        return result;
+    }
+
+    PendingDirectories prefetch(const std::shared_ptr<AkaiFatLfnDirectory> &dir,
+                                const std::vector<std::pair<Entry, std::string>> &children) {
+        std::vector<std::shared_ptr<FatDirectoryEntry>> toRead;
+
+        for (auto &child : children) {
+            auto &realEntry = child.first->realEntry;
+
+            if (realEntry->isDirectory() && !dir->hasCachedDirectory(realEntry))
+                toRead.push_back(realEntry);
+        }
+
+        std::sort(begin(toRead), end(toRead),
+                  [](const std::shared_ptr<FatDirectoryEntry> &a, const std::shared_ptr<FatDirectoryEntry> &b) {
+                      return a->getStartCluster() < b->getStartCluster();
+                  });
+
+        PendingDirectories result;
+        auto fat = dir->getFat();
+        bool readOnly = dir->isReadOnly();
+
+        for (auto &realEntry : toRead) {
+            auto chain = std::make_shared<ClusterChain>(fat.get(), realEntry->getStartCluster(), realEntry->isReadonlyFlag());
+            auto storage = std::make_shared<ClusterChainDirectory>(chain, false);
+
+            ByteBuffer data(static_cast<std::int64_t>(storage->getCapacity()) * FatDirectoryEntry::SIZE);
+            storage->read(data);
+            data.flip();
+
+            auto task = [storage, fat, readOnly, data = std::move(data)]() mutable {
+                return parse(storage, data, fat, readOnly);
+            };
+
+            if (pool)
+                result[realEntry] = pool->submit(std::move(task));
+            else
+                result[realEntry] = std::async(std::launch::deferred, std::move(task));
+        }
+
+        return result;
+    }
+
+    void walk(const std::shared_ptr<AkaiFatLfnDirectory> &dir, const std::string &prefix, std::int32_t depth) {
+        std::vector<std::pair<Entry, std::string>> children;
+
+        {
+            util::ReadLock dirLock(dir->getLock());
+
+            for (auto &e : dir->akaiNameIndex) {
+                if (e.first.empty() || e.first[0] == '.') continue;
+
+                auto path = prefix.empty() ? e.second->getName() : prefix + "/" + e.second->getName();
+
+                if (filter && !filter(e.second, path)) continue;
+
+                children.emplace_back(e.second, path);
+            }
+        }
+
+        auto pending = preVisitor ? PendingDirectories() : prefetch(dir, children);
+
+        for (auto &child : children) {
+            auto &entry = child.first;
+            auto &path = child.second;
+
+            bool descend = !preVisitor || preVisitor(entry, path, depth);
+
+            if (descend && entry->isDirectory()) {
+                std::shared_ptr<AkaiFatLfnDirectory> subDir;
+                auto it = pending.find(entry->realEntry);
+
+                if (it != end(pending))
+                    subDir = dir->adoptDirectory(entry->realEntry, it->second.get());
+                else
+                    subDir = dir->getDirectory(entry->realEntry);
+
+                walk(subDir, path, depth + 1);
+            }
+
+            if (postVisitor) postVisitor(entry, path, depth);
+        }
+    }
+
+public:
+    void setPreVisitor(PreVisitor visitor) {
+        preVisitor = std::move(visitor);
+    }
+
+    void setPostVisitor(PostVisitor visitor) {
+        postVisitor = std::move(visitor);
+    }
+
+    void setFilter(Filter newFilter) {
+        filter = std::move(newFilter);
+    }
+
+    // 0 parses directories on the calling thread
+    void setThreadCount(std::size_t count) {
+        threadCount = count;
+        pool.reset();
+    }
+
+    void walk(const std::shared_ptr<AkaiFatLfnDirectory> &start) {
+        if (threadCount > 0 && !pool)
+            pool = std::make_unique<util::ThreadPool>(threadCount);
+
+        util::ReadLock lock(start->getFat()->getLock());
+        walk(start, "", 0);
+    }
+};
+}
@@ -1,6 +1,7 @@
 #include "AkaiFatFileSystem.hpp"
 
 #include "Fat16RootDirectory.hpp"
+#include "AkaiFatLfnDirectoryEntry.hpp"
 
 using namespace akaifat::fat;
 using namespace akaifat;
@@ -9,15 +10,32 @@ AkaiFatFileSystem::AkaiFatFileSystem(
                                      std::shared_ptr<BlockDevice> device,
                                      bool readOnly,
                                      bool ignoreFatDifferences
+                                     ) : AkaiFatFileSystem(std::move(device), readOnly, ignoreFatDifferences,
+                                                           util::TraceScope("AkaiFatFileSystem::mount"))
+{
+}
+
+AkaiFatFileSystem::AkaiFatFileSystem(
+                                     std::shared_ptr<BlockDevice> device,
+                                     bool readOnly,
+                                     bool ignoreFatDifferences,
+                                     const util::TraceScope & /*mountTrace*/
                                      ) : akaifat::AbstractFileSystem (readOnly),
-                                    bs (std::dynamic_pointer_cast<Fat16BootSector>(BootSector::read(std::move(device))))
+                                    bs (std::dynamic_pointer_cast<Fat16BootSector>(BootSector::read(
+                                            std::make_shared<StatsBlockDevice>(std::move(device), statistics))))
 {
     if (bs->getNrFats() <= 0)
         throw std::runtime_error("boot sector says there are no FATs");
 
     fat = Fat::read(bs, 0);
+    fat->setStats(statistics);
 
-    if (!ignoreFatDifferences)
+    if (ignoreFatDifferences)
+    {
+        // The first flush brings all copies in line with FAT 0
+        fat->markAllDirty();
+    }
+    else
     {
         for (std::int32_t i=1; i < bs->getNrFats(); i++)
         {
@@ -51,6 +69,8 @@ void AkaiFatFileSystem::setVolumeLabel(std::string label)
     checkClosed();
     checkReadOnly();
 
+    util::WriteLock lock(fat->getLock());
+
     rootDirStore->setLabel(label);
     bs->setVolumeLabel(label);
 }
@@ -59,15 +79,86 @@ void AkaiFatFileSystem::flush()
 {
     checkClosed();
 
+    util::WriteLock lock(fat->getLock());
+    util::TraceScope trace("AkaiFatFileSystem::flush");
+    ScopedLatency latency(*statistics, statistics->flushLatency);
+
     if (bs->isDirty()) {
         bs->write();
     }
 
-    for (std::int32_t i = 0; i < bs->getNrFats(); i++) {
-        fat->writeCopy(bs->getFatOffset(i));
-    }
+    fat->writeDirtyCopies();
 
     rootDir->flush();
+
+    fat->clearDirtyBytes();
+
+    releaseEvictedDirectories();
+}
+
+void AkaiFatFileSystem::trimCaches()
+{
+    checkClosed();
+
+    util::WriteLock lock(fat->getLock());
+    releaseEvictedDirectories();
+}
+
+void AkaiFatFileSystem::releaseEvictedDirectories()
+{
+    auto objectCache = fat->getObjectCache();
+    auto directories = objectCache->takeEvictedDirectories();
+
+    // A directory goes only after its subdirectories, so repeat while that frees more
+    for (bool released = true; released;) {
+        released = false;
+
+        for (auto it = begin(directories); it != end(directories);) {
+            if ((*it)->release()) {
+                it = directories.erase(it);
+                released = true;
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    for (auto &directory : directories)
+        objectCache->addEvictedDirectory(directory);
+}
+
+void AkaiFatFileSystem::sync()
+{
+    flush();
+
+    auto device = bs->getDevice();
+    device->flush();
+    device->sync();
+}
+
+std::int64_t AkaiFatFileSystem::getDirtyBytes()
+{
+    return fat->getDirtyBytes();
+}
+
+std::int64_t AkaiFatFileSystem::getMemoryUsage()
+{
+    checkClosed();
+
+    std::int64_t result = fat->getMemoryUsage() + rootDir->getMemoryUsage();
+
+    std::lock_guard<std::mutex> guard(dentryCacheMutex);
+    return result + static_cast<std::int64_t>(dentryCache.size()) * DentryCache::DENTRY_MEMORY;
+}
+
+bool AkaiFatFileSystem::isInUse()
+{
+    checkClosed();
+
+    // Views keep the mapping of the device, which holds it once itself
+    if (bs->getDevice()->getMapping().use_count() > 2) return true;
+
+    return rootDir->isInUse(1);
 }
 
 std::shared_ptr<FsDirectory> AkaiFatFileSystem::getRoot()
@@ -77,6 +168,86 @@ std::shared_ptr<FsDirectory> AkaiFatFileSystem::getRoot()
     return rootDir;
 }
 
+std::shared_ptr<AkaiFatLfnDirectoryEntry> AkaiFatFileSystem::resolve(const std::string &path)
+{
+    checkClosed();
+
+    std::vector<std::string> names;
+    std::string key;
+    std::string name;
+
+    for (size_t i = 0; i <= path.length(); i++) {
+        if (i == path.length() || path[i] == '/' || path[i] == '\\') {
+            if (!name.empty()) {
+                names.push_back(name);
+                key += (key.empty() ? "" : "/") + name;
+                name.clear();
+            }
+        } else {
+            name.push_back(static_cast<char>(tolower(path[i])));
+        }
+    }
+
+    if (names.empty()) return {};
+
+    util::ReadLock lock(fat->getLock());
+    std::shared_ptr<AkaiFatLfnDirectoryEntry> result;
+
+    {
+        std::lock_guard<std::mutex> guard(dentryCacheMutex);
+        if (dentryCache.lookup(key, result)) {
+            statistics->count(statistics->dentryCacheHits);
+            return result;
+        }
+    }
+
+    statistics->count(statistics->dentryCacheMisses);
+
+    DentryCache::Dentry dentry;
+    auto dir = rootDir;
+
+    for (size_t i = 0; i < names.size(); i++) {
+        dentry.steps.push_back({dir, dir->getGeneration()});
+
+        auto entry = std::dynamic_pointer_cast<AkaiFatLfnDirectoryEntry>(dir->getEntry(names[i]));
+
+        if (!entry) break;
+
+        if (i == names.size() - 1) {
+            result = entry;
+            break;
+        }
+
+        if (!entry->isDirectory()) break;
+
+        dir = dir->getDirectory(entry->realEntry);
+    }
+
+    dentry.entry = result;
+    dentry.negative = !result;
+
+    std::lock_guard<std::mutex> guard(dentryCacheMutex);
+    dentryCache.insert(key, std::move(dentry));
+
+    return result;
+}
+
+void AkaiFatFileSystem::setDentryCacheCapacity(std::size_t capacity)
+{
+    std::lock_guard<std::mutex> guard(dentryCacheMutex);
+    dentryCache.setCapacity(capacity);
+}
+
+void AkaiFatFileSystem::setCacheMemoryLimit(std::int64_t bytes)
+{
+    fat->getObjectCache()->setLimit(bytes);
+}
+
+FileSystemStats &AkaiFatFileSystem::stats()
+{
+    return *statistics;
+}
+
 std::shared_ptr<BootSector> AkaiFatFileSystem::getBootSector()
 {
     checkClosed();
@@ -88,6 +259,7 @@ std::int64_t AkaiFatFileSystem::getFreeSpace()
 {
     checkClosed();
 
+    util::ReadLock lock(fat->getLock());
     return fat->getFreeClusterCount() * bs->getBytesPerCluster();
 }
 
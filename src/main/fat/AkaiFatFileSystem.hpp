@@ -3,19 +3,36 @@
 #include "../AbstractFileSystem.hpp"
 
 #include "AkaiFatLfnDirectory.hpp"
+#include "DentryCache.hpp"
 #include "Fat.hpp"
+#include "FileSystemStats.hpp"
 #include "Fat16BootSector.hpp"
 
 #include <memory>
+#include <mutex>
 
 namespace akaifat::fat {
 class AkaiFatFileSystem : public akaifat::AbstractFileSystem
 {
 private:
+    // Declared before bs, which reads through a device that counts into it
+    std::shared_ptr<FileSystemStats> statistics = std::make_shared<FileSystemStats>();
     std::shared_ptr<Fat> fat;
     std::shared_ptr<Fat16BootSector> bs;
     std::shared_ptr<AkaiFatLfnDirectory> rootDir;
     std::shared_ptr<AbstractDirectory> rootDirStore;
+    DentryCache dentryCache{1024};
+    // Concurrent resolve() calls share the file system lock but all update the cache
+    std::mutex dentryCacheMutex;
+
+    // Frees the evicted directories that nothing refers to anymore. Needs the file system
+    // lock held exclusively.
+    void releaseEvictedDirectories();
+
+    // Mounts. The public constructor passes a temporary mountTrace, which lives until this
+    // returns, so the trace covers reading the boot sector in the initializer list too.
+    AkaiFatFileSystem(std::shared_ptr<BlockDevice> device, bool readOnly, bool ignoreFatDifferences,
+                      const util::TraceScope &mountTrace);
 
 public:
     AkaiFatFileSystem(std::shared_ptr<BlockDevice> device, bool readOnly,
@@ -30,10 +47,46 @@ public:
 
     void setVolumeLabel(std::string label);
 
+    // Writes the boot sector, the changed sectors of the FAT and all loaded directories, then
+    // frees the directories evicted from the object cache
     void flush() override;
+
+    // Flushes and then has the device make everything durable, if it can, see
+    // BlockDevice::canSync()
+    void sync();
+
+    // Bytes changed since the last flush, see Fat::getDirtyBytes(). Takes no locks.
+    std::int64_t getDirtyBytes();
     
+    // Estimated heap use of the FAT, the cached directories and files and the path cache
+    std::int64_t getMemoryUsage();
+
+    // True while callers hold directories, entries, files, streams or views obtained from
+    // this file system. Says nothing about callers holding the file system itself.
+    bool isInUse();
+
     std::shared_ptr<FsDirectory> getRoot() override;
 
+    // Resolves a slash or backslash separated path below the root, e.g. "SAMPLES/KICKS/KICK01.SND".
+    // Names are matched case-insensitively. Returns nullptr if the path does not exist.
+    // Results, including misses, are kept in a bounded cache that stays coherent with
+    // adds, renames, moves and removes.
+    std::shared_ptr<AkaiFatLfnDirectoryEntry> resolve(const std::string &path);
+
+    void setDentryCacheCapacity(std::size_t capacity);
+
+    // Bounds the estimated memory of the files and subdirectories kept loaded. Directories
+    // that fall out are freed by the next flush() or trimCaches().
+    void setCacheMemoryLimit(std::int64_t bytes);
+
+    // Frees the evicted directories without flushing the rest of the file system. Unflushed
+    // changes of those directories are written first.
+    void trimCaches();
+
+    // Counters and latency histograms of this mount. Recording is off until
+    // stats().setEnabled(true). Device I/O is counted as it leaves the file system.
+    FileSystemStats &stats();
+
     std::shared_ptr<BootSector> getBootSector();
 
     std::int64_t getFreeSpace() override;
@@ -24,36 +24,195 @@ std::shared_ptr<Fat> AkaiFatLfnDirectory::getFat() {
     return fat;
 }
 
+std::shared_ptr<akaifat::util::BlockPool> AkaiFatLfnDirectory::getEntryPool() {
+    return entryPool;
+}
+
+std::uint64_t AkaiFatLfnDirectory::getGeneration() const {
+    return generation;
+}
+
+akaifat::util::ReentrantSharedMutex &AkaiFatLfnDirectory::getLock() {
+    return lock;
+}
+
+std::shared_ptr<const AkaiFatLfnDirectory::Snapshot> AkaiFatLfnDirectory::getSnapshot() const {
+    auto result = std::atomic_load(&snapshot);
+
+    if (!result) {
+        static const auto empty = std::make_shared<const Snapshot>();
+        return empty;
+    }
+
+    return result;
+}
+
+void AkaiFatLfnDirectory::publishSnapshot() {
+    auto next = std::make_shared<Snapshot>();
+    next->generation = generation;
+    next->items.reserve(akaiNameIndex.size());
+
+    for (auto &e : akaiNameIndex) {
+        if (e.first.empty() || e.first[0] == '.') continue;
+        next->items.push_back({e.second->fileName, e.second->isDirectory(), e.second});
+    }
+
+    std::atomic_store(&snapshot, std::shared_ptr<const Snapshot>(std::move(next)));
+}
+
 std::shared_ptr<FatFile> AkaiFatLfnDirectory::getFile(const std::shared_ptr<FatDirectoryEntry>& entry) {
+    util::ReadLock fsLock(fat->getLock());
+    util::ReadLock dirLock(lock);
+
     std::shared_ptr<FatFile> file;
 
-    if (entryToFile.find(entry) == end(entryToFile)) {
-        file = FatFile::get(fat.get(), entry);
-        entryToFile[entry] = file;
-    } else {
-        file = entryToFile[entry];
+    {
+        std::lock_guard<std::mutex> guard(cacheMutex);
+        auto it = entryToFile.find(entry);
+
+        if (it != end(entryToFile)) file = it->second.lock();
+    }
+
+    auto &stats = fat->getStats();
+    stats.count(file ? stats.objectCacheHits : stats.objectCacheMisses);
+
+    if (!file) {
+        // Another reader may be creating the same file, the first one to finish wins
+        auto created = FatFile::get(fat.get(), entry);
+        created->setDirectoryLock(std::shared_ptr<util::ReentrantSharedMutex>(shared_from_this(), &lock));
+
+        std::lock_guard<std::mutex> guard(cacheMutex);
+        auto &cached = entryToFile[entry];
+        file = cached.lock();
+
+        if (!file) {
+            cached = created;
+            file = created;
+        }
     }
 
+    fat->getObjectCache()->touch(file, file->getMemoryUsage());
     return file;
 }
 
 std::shared_ptr<AkaiFatLfnDirectory> AkaiFatLfnDirectory::getDirectory(const std::shared_ptr<FatDirectoryEntry>& entry)
 {
+    util::ReadLock fsLock(fat->getLock());
+    util::ReadLock dirLock(lock);
+
+    {
+        std::lock_guard<std::mutex> guard(cacheMutex);
+        auto it = entryToDirectory.find(entry);
+
+        if (it != end(entryToDirectory)) {
+            if (auto cached = it->second.lock()) {
+                fat->getStats().count(fat->getStats().objectCacheHits);
+                fat->getObjectCache()->touch(cached, cached->getCacheCost());
+                return cached;
+            }
+        }
+    }
+
+    fat->getStats().count(fat->getStats().objectCacheMisses);
+
+    auto storage = read(entry, fat.get());
+    auto result = std::make_shared<AkaiFatLfnDirectory>(storage, fat, isReadOnly());
+    result->parseLfn();
+
+    return adoptDirectory(entry, result);
+}
+
+bool AkaiFatLfnDirectory::hasCachedDirectory(const std::shared_ptr<FatDirectoryEntry>& entry) {
+    util::ReadLock fsLock(fat->getLock());
+    util::ReadLock dirLock(lock);
+    std::lock_guard<std::mutex> guard(cacheMutex);
+    auto it = entryToDirectory.find(entry);
+    return it != end(entryToDirectory) && !it->second.expired();
+}
+
+std::int64_t AkaiFatLfnDirectory::getMemoryUsage() {
+    util::ReadLock fsLock(fat->getLock());
+    std::vector<std::shared_ptr<FatFile>> files;
+    std::vector<std::shared_ptr<AkaiFatLfnDirectory>> subDirectories;
+    std::int64_t result = sizeof(AkaiFatLfnDirectory);
+
+    {
+        util::ReadLock dirLock(lock);
+        result += dir->getCapacity() * ENTRY_MEMORY;
+
+        std::lock_guard<std::mutex> guard(cacheMutex);
+        for (auto &e : entryToFile)
+            if (auto file = e.second.lock()) files.push_back(file);
+
+        for (auto &e : entryToDirectory)
+            if (auto subDirectory = e.second.lock()) subDirectories.push_back(subDirectory);
+    }
+
+    // Children are visited without holding this directory's lock
+    for (auto &file : files)
+        result += file->getMemoryUsage();
+
+    for (auto &subDirectory : subDirectories)
+        result += subDirectory->getMemoryUsage();
+
+    return result;
+}
+
+bool AkaiFatLfnDirectory::isInUse(long holders) {
+    util::ReadLock fsLock(fat->getLock());
+    auto objectCache = fat->getObjectCache();
+    std::vector<std::shared_ptr<FatFile>> files;
+    std::vector<std::shared_ptr<AkaiFatLfnDirectory>> subDirectories;
+
+    {
+        util::ReadLock dirLock(lock);
+
+        if (isReferencedOutside(holders)) return true;
+
+        std::lock_guard<std::mutex> guard(cacheMutex);
+        for (auto &e : entryToFile)
+            if (auto file = e.second.lock()) files.push_back(file);
+
+        for (auto &e : entryToDirectory)
+            if (auto subDirectory = e.second.lock()) subDirectories.push_back(subDirectory);
+    }
+
+    // Besides the callers, only the vectors above and the object cache hold them
+    for (auto &file : files)
+        if (file.use_count() > 1 + static_cast<long>(objectCache->contains(file.get()))) return true;
+
+    for (auto &subDirectory : subDirectories)
+        if (subDirectory->isInUse(1 + static_cast<long>(objectCache->contains(subDirectory.get())))) return true;
+
+    return false;
+}
+
+std::shared_ptr<AkaiFatLfnDirectory> AkaiFatLfnDirectory::adoptDirectory(const std::shared_ptr<FatDirectoryEntry>& entry,
+                                                                         const std::shared_ptr<AkaiFatLfnDirectory>& directory)
+{
+    util::ReadLock fsLock(fat->getLock());
+    util::ReadLock dirLock(lock);
     std::shared_ptr<AkaiFatLfnDirectory> result;
 
-    if (entryToDirectory.find(entry) == end(entryToDirectory)) {
-        auto storage = read(entry, fat.get());
-        result = std::make_shared<AkaiFatLfnDirectory>(storage, fat, isReadOnly());
-        result->parseLfn();
-        entryToDirectory[entry] = result;
-    } else {
-        result = entryToDirectory[entry];
+    {
+        std::lock_guard<std::mutex> guard(cacheMutex);
+        auto &cached = entryToDirectory[entry];
+        result = cached.lock();
+
+        if (!result) {
+            cached = directory;
+            result = directory;
+        }
     }
 
+    fat->getObjectCache()->touch(result, result->getCacheCost());
     return result;
 }
 
 std::shared_ptr<FsDirectoryEntry> AkaiFatLfnDirectory::addFile(std::string &name) {
+    util::ReadLock fsLock(fat->getLock());
+    util::WriteLock dirLock(lock);
+
     checkWritable();
     checkUniqueName(name);
 
@@ -61,16 +220,157 @@ std::shared_ptr<FsDirectoryEntry> AkaiFatLfnDirectory::addFile(std::string &name
 
     auto entry = std::make_shared<AkaiFatLfnDirectoryEntry>(name, shared_from_this(), false);
 
-    dir->addEntry(entry->realEntry);
+    if (isInBatch())
+        reserveSlots(entry->compactSize());
+    else
+        dir->addEntry(entry->realEntry);
+
     auto nameLower = AkaiStrUtil::to_lower_copy(name);
     akaiNameIndex[nameLower] = entry;
+    changed();
+
+    if (!isInBatch())
+        publishSnapshot();
 
     getFile(entry->realEntry);
 
     return entry;
 }
 
+std::vector<std::shared_ptr<FsDirectoryEntry>> AkaiFatLfnDirectory::addFiles(std::vector<std::string> &names) {
+    util::WriteLock fsLock(fat->getLock());
+
+    checkWritable();
+
+    std::set<std::string> newNames;
+    std::vector<std::shared_ptr<AkaiFatLfnDirectoryEntry>> newEntries;
+    newEntries.reserve(names.size());
+    std::int32_t newSlots = 0;
+
+    for (auto &name : names) {
+        auto trimmedName = AkaiStrUtil::trim(name);
+        auto lowerName = AkaiStrUtil::to_lower_copy(trimmedName);
+
+        if (trimmedName.empty())
+            throw std::runtime_error("file name is empty");
+
+        if (usedAkaiNames.find(lowerName) != usedAkaiNames.end() || !newNames.emplace(lowerName).second)
+            throw std::runtime_error("an entry named " + trimmedName + " already exists");
+
+        // The constructor validates the short name and Akai part
+        auto entry = std::make_shared<AkaiFatLfnDirectoryEntry>(trimmedName, shared_from_this(), false);
+        newSlots += entry->compactSize();
+        newEntries.push_back(entry);
+    }
+
+    beginBatch();
+
+    try {
+        reserveSlots(newSlots);
+    } catch (std::exception &) {
+        batchDepth--;
+        throw;
+    }
+
+    std::vector<std::shared_ptr<FsDirectoryEntry>> result;
+    result.reserve(newEntries.size());
+
+    for (auto &entry : newEntries) {
+        auto lowerName = AkaiStrUtil::to_lower_copy(entry->getName());
+        usedAkaiNames.emplace(lowerName);
+        akaiNameIndex[lowerName] = entry;
+        getFile(entry->realEntry);
+        result.push_back(entry);
+    }
+
+    changed();
+
+    commitBatch();
+
+    return result;
+}
+
+void AkaiFatLfnDirectory::beginBatch() {
+    util::ReadLock fsLock(fat->getLock());
+    util::WriteLock dirLock(lock);
+
+    checkWritable();
+
+    if (batchDepth++ == 0)
+        batchSlots = getCompactSize();
+}
+
+void AkaiFatLfnDirectory::commitBatch() {
+    util::WriteLock fsLock(fat->getLock());
+
+    if (batchDepth == 0)
+        throw std::runtime_error("no batch in progress");
+
+    if (--batchDepth > 0) return;
+
+    updateLFN();
+    dir->flush();
+    fat->writeDirtyCopies();
+    publishSnapshot();
+}
+
+void AkaiFatLfnDirectory::changed() {
+    generation++;
+    dirty = true;
+    fat->addDirtyBytes(FatDirectoryEntry::SIZE);
+}
+
+bool AkaiFatLfnDirectory::isInBatch() const {
+    return batchDepth > 0;
+}
+
+bool AkaiFatLfnDirectory::hasUnflushedChanges() {
+    if (dirty) return true;
+
+    // Files change their length and start cluster in place
+    for (std::int32_t i = 0; i < dir->getEntryCount(); i++)
+        if (dir->getEntry(i)->isDirty()) return true;
+
+    return false;
+}
+
+std::int64_t AkaiFatLfnDirectory::getCacheCost() const {
+    // The snapshot can be read without the directory lock
+    auto current = getSnapshot();
+    const auto entryCount = current ? current->items.size() : 0;
+    return static_cast<std::int64_t>(sizeof(AkaiFatLfnDirectory) + entryCount * ENTRY_MEMORY);
+}
+
+std::int32_t AkaiFatLfnDirectory::getCompactSize() {
+    std::int32_t result = 0;
+
+    for (auto &entry : akaiNameIndex)
+        result += entry.second->compactSize();
+
+    return result;
+}
+
+void AkaiFatLfnDirectory::reserveSlots(std::int32_t count) {
+    auto needed = batchSlots + count;
+
+    if (needed > dir->getCapacity()) {
+        if (dir->isRoot()) {
+            dir->changeSize(needed);
+        } else {
+            // Grow geometrically so a batch of single adds doesn't resize the chain every time.
+            // commitBatch() trims the directory back to its exact size.
+            const std::int32_t maxSlots = ClusterChainDirectory::MAX_SIZE / FatDirectoryEntry::SIZE;
+            dir->changeSize(std::min(maxSlots, std::max(needed, dir->getCapacity() * 2)));
+        }
+    }
+
+    batchSlots = needed;
+}
+
 bool AkaiFatLfnDirectory::isFreeName(std::string &name) {
+    util::ReadLock fsLock(fat->getLock());
+    util::ReadLock dirLock(lock);
+
     return usedAkaiNames.find(AkaiStrUtil::to_lower_copy(name)) == usedAkaiNames.end();
 }
 
@@ -87,6 +387,8 @@ std::vector<std::string> AkaiFatLfnDirectory::splitName(std::string &s) {
 }
 
 std::shared_ptr<FsDirectoryEntry> AkaiFatLfnDirectory::addDirectory(std::string &_name) {
+    util::WriteLock fsLock(fat->getLock());
+
     checkWritable();
     checkUniqueName(_name);
     auto name = AkaiStrUtil::trim(_name);
@@ -96,9 +398,13 @@ std::shared_ptr<FsDirectoryEntry> AkaiFatLfnDirectory::addDirectory(std::string
     auto e = std::make_shared<AkaiFatLfnDirectoryEntry>(shared_from_this(), real, name);
 
     try {
-        for (auto& compactFormEntry : e->compactForm())
-        {
-            dir->addEntry(compactFormEntry);
+        if (isInBatch()) {
+            reserveSlots(e->compactSize());
+        } else {
+            for (auto& compactFormEntry : e->compactForm())
+            {
+                dir->addEntry(compactFormEntry);
+            }
         }
     } catch (std::exception &ex) {
         ClusterChain cc(fat.get(), real->getStartCluster(), false);
@@ -108,14 +414,22 @@ std::shared_ptr<FsDirectoryEntry> AkaiFatLfnDirectory::addDirectory(std::string
     }
 
     akaiNameIndex[AkaiStrUtil::to_lower_copy(name)] = e;
+    changed();
 
     getDirectory(real);
 
-    flush();
+    if (!isInBatch()) {
+        flush();
+        publishSnapshot();
+    }
+
     return e;
 }
 
 std::shared_ptr<FsDirectoryEntry> AkaiFatLfnDirectory::getEntry(std::string &name) {
+    util::ReadLock fsLock(fat->getLock());
+    util::ReadLock dirLock(lock);
+
     if (akaiNameIndex.find(name) != akaiNameIndex.end()) return akaiNameIndex[name];
     
     if (akaiNameIndex.find(AkaiStrUtil::to_lower_copy(name)) != akaiNameIndex.end())
@@ -125,19 +439,68 @@ std::shared_ptr<FsDirectoryEntry> AkaiFatLfnDirectory::getEntry(std::string &nam
 }
 
 void AkaiFatLfnDirectory::flush() {
+    util::WriteLock fsLock(fat->getLock());
+
     checkWritable();
 
+    auto &stats = fat->getStats();
+    ScopedLatency latency(stats, stats.directoryFlushLatency);
+    stats.count(stats.directoryFlushes);
+
     for (const auto& f : entryToFile)
-        f.second->flush();
+        if (auto file = f.second.lock()) file->flush();
 
     for (const auto& d : entryToDirectory)
-        d.second->flush();
+        if (auto subDirectory = d.second.lock()) subDirectory->flush();
 
     updateLFN();
     dir->flush();
+    dirty = false;
+}
+
+bool AkaiFatLfnDirectory::isReferencedOutside(long holders) {
+    // Only the holders and the entries of this directory refer to it
+    if (weak_from_this().use_count() > holders + static_cast<long>(akaiNameIndex.size())) return true;
+
+    // and only the index and the published snapshot refer to the entries
+    std::set<const AkaiFatLfnDirectoryEntry *> published;
+
+    if (auto current = getSnapshot())
+        for (auto &item : current->items)
+            published.insert(item.entry.get());
+
+    for (auto &e : akaiNameIndex)
+        if (e.second.use_count() > 1 + static_cast<long>(published.count(e.second.get()))) return true;
+
+    return false;
+}
+
+bool AkaiFatLfnDirectory::release() {
+    if (isInBatch() || !isValid()) return false;
+
+    if (!isReadOnly() && hasUnflushedChanges()) flush();
+
+    for (auto &f : entryToFile)
+        if (!f.second.expired()) return false;
+
+    for (auto &d : entryToDirectory)
+        if (!d.second.expired()) return false;
+
+    if (isReferencedOutside(1)) return false;
+
+    std::atomic_store(&snapshot, std::shared_ptr<const Snapshot>());
+    akaiNameIndex.clear();
+    usedAkaiNames.clear();
+    entryToFile.clear();
+    entryToDirectory.clear();
+    invalidate();
+    return true;
 }
 
 void AkaiFatLfnDirectory::remove(std::string name) {
+    // Exclusive, so no FatFile of this directory is writing to the chain that is freed here
+    util::WriteLock fsLock(fat->getLock());
+
     checkWritable();
 
     auto entry = getEntry(name);
@@ -147,17 +510,104 @@ void AkaiFatLfnDirectory::remove(std::string name) {
     auto akaiEntry = std::dynamic_pointer_cast<AkaiFatLfnDirectoryEntry>(entry);
     auto entryName = akaiEntry->getAkaiName();
     auto isFile = akaiEntry->isFile();
+
+    std::shared_ptr<FatFile> openFile;
+
+    if (isFile) {
+        std::lock_guard<std::mutex> guard(cacheMutex);
+        auto it = entryToFile.find(akaiEntry->realEntry);
+
+        if (it != end(entryToFile)) openFile = it->second.lock();
+    }
+
     unlinkEntry(entryName, isFile, akaiEntry->realEntry);
 
-    // Temporary helper object to modify the fat
-    ClusterChain cc(fat.get(), akaiEntry->realEntry->getStartCluster(), false);
-    cc.setChainLength(0);
+    if (openFile) {
+        // Truncate through the open file, so it does not keep writing to the freed clusters
+        openFile->setLength(0);
+    } else {
+        // Temporary helper object to modify the fat
+        ClusterChain cc(fat.get(), akaiEntry->realEntry->getStartCluster(), false);
+        cc.setChainLength(0);
+    }
 
-    updateLFN();
+    if (!isInBatch()) {
+        updateLFN();
+        publishSnapshot();
+    }
+}
+
+void AkaiFatLfnDirectory::removeTree(std::string name) {
+    util::WriteLock fsLock(fat->getLock());
+
+    checkWritable();
+
+    auto entry = std::dynamic_pointer_cast<AkaiFatLfnDirectoryEntry>(getEntry(name));
+
+    if (!entry) return;
+
+    removeEntries({entry});
+}
+
+void AkaiFatLfnDirectory::removeAll() {
+    util::WriteLock fsLock(fat->getLock());
+
+    checkWritable();
+
+    std::vector<std::shared_ptr<AkaiFatLfnDirectoryEntry>> toRemove;
+
+    for (auto &e : akaiNameIndex) {
+        if (e.first.empty() || e.first[0] == '.') continue;
+        toRemove.push_back(e.second);
+    }
+
+    removeEntries(toRemove);
+}
+
+void AkaiFatLfnDirectory::removeEntries(const std::vector<std::shared_ptr<AkaiFatLfnDirectoryEntry>> &toRemove) {
+    std::vector<std::int64_t> startClusters;
+
+    for (auto &entry : toRemove) {
+        collectChains(entry, startClusters);
+
+        auto entryName = entry->getAkaiName();
+        unlinkEntry(entryName, entry->isFile(), entry->realEntry);
+    }
+
+    fat->freeChains(startClusters);
+
+    if (!isInBatch()) {
+        updateLFN();
+        publishSnapshot();
+    }
+}
+
+void AkaiFatLfnDirectory::collectChains(const std::shared_ptr<AkaiFatLfnDirectoryEntry> &entry,
+                                        std::vector<std::int64_t> &startClusters) {
+    if (entry->isDirectory()) {
+        auto subDir = getDirectory(entry->realEntry);
+
+        for (auto &e : subDir->akaiNameIndex) {
+            if (e.first.empty() || e.first[0] == '.') continue;
+            subDir->collectChains(e.second, startClusters);
+        }
+
+        subDir->entryToFile.clear();
+        subDir->entryToDirectory.clear();
+        subDir->invalidate();
+    }
+
+    auto startCluster = entry->realEntry->getStartCluster();
+
+    if (startCluster != 0)
+        startClusters.push_back(startCluster);
 }
 
 std::shared_ptr<AkaiFatLfnDirectoryEntry>
 AkaiFatLfnDirectory::unlinkEntry(std::string &entryName, bool isFile, const std::shared_ptr<FatDirectoryEntry>& realEntry) {
+    util::ReadLock fsLock(fat->getLock());
+    util::WriteLock dirLock(lock);
+
     if (entryName.empty() || entryName[0] == '.') return {};
 
     std::string lowerName = AkaiStrUtil::to_lower_copy(entryName);
@@ -167,6 +617,10 @@ AkaiFatLfnDirectory::unlinkEntry(std::string &entryName, bool isFile, const std:
     auto unlinkedEntryRef = akaiNameIndex[lowerName];
 
     akaiNameIndex.erase(lowerName);
+    changed();
+
+    if (isInBatch())
+        batchSlots -= unlinkedEntryRef->compactSize();
 
     assert(usedAkaiNames.find(lowerName) != usedAkaiNames.end());
     usedAkaiNames.erase(lowerName);
@@ -181,11 +635,23 @@ AkaiFatLfnDirectory::unlinkEntry(std::string &entryName, bool isFile, const std:
 }
 
 void AkaiFatLfnDirectory::linkEntry(const std::shared_ptr<AkaiFatLfnDirectoryEntry> &entry) {
+    util::ReadLock fsLock(fat->getLock());
+    util::WriteLock dirLock(lock);
+
     auto name = entry->getName();
+
+    if (isInBatch())
+        reserveSlots(entry->compactSize());
+
     checkUniqueName(name);
     entry->realEntry->setAkaiName(name);
     akaiNameIndex[AkaiStrUtil::to_lower_copy(name)] = entry;
-    updateLFN();
+    changed();
+
+    if (!isInBatch()) {
+        updateLFN();
+        publishSnapshot();
+    }
 }
 
 void AkaiFatLfnDirectory::checkUniqueName(std::string &name) {
@@ -197,6 +663,11 @@ void AkaiFatLfnDirectory::checkUniqueName(std::string &name) {
 }
 
 void AkaiFatLfnDirectory::parseLfn() {
+    util::TraceScope trace("AkaiFatLfnDirectory::parseLfn");
+    auto &stats = fat->getStats();
+    ScopedLatency latency(stats, stats.directoryParseLatency);
+    stats.count(stats.directoryParses);
+
     std::int32_t i = 0;
     std::int32_t size = dir->getEntryCount();
 
@@ -231,15 +702,18 @@ void AkaiFatLfnDirectory::parseLfn() {
             akaiNameIndex[nameLower] = current;
         }
     }
+
+    publishSnapshot();
 }
 
 void AkaiFatLfnDirectory::updateLFN() {
+    util::TraceScope trace("AkaiFatLfnDirectory::updateLFN");
+
     std::vector<std::shared_ptr<FatDirectoryEntry>> dest;
+    dest.reserve(akaiNameIndex.size() * 2);
 
-    for (auto& entry : akaiNameIndex) {
-        for (auto& e : entry.second->compactForm())
-            dest.emplace_back(e);
-    }
+    for (auto& entry : akaiNameIndex)
+        entry.second->appendCompactForm(dest);
     
     dir->changeSize(static_cast<int>(dest.size()));
     dir->setEntries(dest);
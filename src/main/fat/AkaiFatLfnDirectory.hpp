@@ -8,7 +8,9 @@
 #include "Fat.hpp"
 #include "FatFile.hpp"
 
+#include <atomic>
 #include <memory>
+#include <mutex>
 #include <set>
 
 namespace akaifat { class FsDirectoryEntry; }
@@ -19,21 +21,87 @@ namespace akaifat::fat {
 
     class AkaiFatLfnDirectoryEntry;
 
+    // Every operation takes the file system lock (Fat::getLock()) shared and then the lock of
+    // this directory, shared for reads and exclusively for changes, so writers in different
+    // directories run in parallel. Operations that write to the device, touch more than one
+    // directory or free clusters an open FatFile may be using (flush, commitBatch, addDirectory,
+    // remove, removeTree, removeAll) take the file system lock exclusively instead. The lock of
+    // this directory also guards the entries of its files: a FatFile takes it exclusively,
+    // before its own lock, when it changes the start cluster or length of its entry. Code that
+    // iterates akaiNameIndex directly has to hold getLock() as well.
     class AkaiFatLfnDirectory : public akaifat::AbstractFsObject, public akaifat::FsDirectory, public std::enable_shared_from_this<AkaiFatLfnDirectory> {
     public:
         std::shared_ptr<AbstractDirectory> dir;
         std::map<std::string, std::shared_ptr<AkaiFatLfnDirectoryEntry>> akaiNameIndex;
 
+        // Immutable listing of the directory as of one generation, without the "." and ".."
+        // entries. Items are ordered by lower case name, like akaiNameIndex.
+        struct Snapshot {
+            struct Item {
+                std::string name;
+                bool directory;
+                std::shared_ptr<AkaiFatLfnDirectoryEntry> entry;
+            };
+
+            std::uint64_t generation = 0;
+            std::vector<Item> items;
+        };
+
         AkaiFatLfnDirectory(std::shared_ptr<AbstractDirectory> dir, std::shared_ptr<Fat> fat, bool readOnly);
 
         std::shared_ptr<Fat> getFat();
 
+        // Entries parsed by parseLfn() are allocated from this pool
+        std::shared_ptr<util::BlockPool> getEntryPool();
+
+        // Changes whenever an entry is added to, removed from or renamed in this directory
+        std::uint64_t getGeneration() const;
+
+        util::ReentrantSharedMutex &getLock();
+
+        // The listing published by the last change. Takes no locks and never blocks, so it can
+        // be called while other threads change the directory; they publish a new snapshot
+        // instead of touching this one. Changes made inside a batch appear at commitBatch().
+        std::shared_ptr<const Snapshot> getSnapshot() const;
+
+        // Publishes the current index as the new snapshot. The caller holds getLock() or the
+        // file system lock exclusively, or is the only one using the directory.
+        void publishSnapshot();
+
         std::shared_ptr<FatFile> getFile(const std::shared_ptr<FatDirectoryEntry>& entry);
 
         std::shared_ptr<AkaiFatLfnDirectory> getDirectory(const std::shared_ptr<FatDirectoryEntry>& entry);
 
+        // True if the subdirectory is loaded
+        bool hasCachedDirectory(const std::shared_ptr<FatDirectoryEntry>& entry);
+
+        // Estimated heap use of this directory and of the files and subdirectories it caches,
+        // recursively, including the read-ahead and stream buffers of the files
+        std::int64_t getMemoryUsage();
+
+        // True while anything besides the file system refers to this directory, its entries or
+        // its loaded files and subdirectories, recursively. holders is the number of references
+        // to this directory that the caller accounts for, e.g. its own.
+        bool isInUse(long holders);
+
+        // Caches a subdirectory that was read and parsed elsewhere, unless one is cached already.
+        // Returns the cached subdirectory.
+        std::shared_ptr<AkaiFatLfnDirectory> adoptDirectory(const std::shared_ptr<FatDirectoryEntry>& entry,
+                                                            const std::shared_ptr<AkaiFatLfnDirectory>& directory);
+
         std::shared_ptr<akaifat::FsDirectoryEntry> addFile(std::string &name) override;
 
+        // Adds all names in one go. Every name is validated before the directory is touched,
+        // the directory grows once to its final size and is written once.
+        std::vector<std::shared_ptr<akaifat::FsDirectoryEntry>> addFiles(std::vector<std::string> &names);
+
+        // Between beginBatch() and commitBatch(), addFile, addDirectory, remove and renames only
+        // update the in-memory index. commitBatch() rewrites the directory and the FAT once.
+        // Batches nest; only the outermost commitBatch() writes.
+        void beginBatch();
+
+        void commitBatch();
+
         bool isFreeName(std::string &name);
 
         static std::vector<std::string> splitName(std::string &s);
@@ -46,6 +114,13 @@ namespace akaifat::fat {
 
         void remove(std::string name) override;
 
+        // Removes the entry and, if it is a directory, everything below it. The cluster chains
+        // of the whole tree are freed in one FAT pass and this directory is rebuilt once.
+        void removeTree(std::string name);
+
+        // Recursively removes every entry of this directory
+        void removeAll();
+
         std::shared_ptr<AkaiFatLfnDirectoryEntry>
         unlinkEntry(std::string &entryName, bool isFile, const std::shared_ptr<FatDirectoryEntry>& realEntry);
 
@@ -53,11 +128,58 @@ namespace akaifat::fat {
 
         void parseLfn();
 
+        // Writes back unflushed changes and drops the parsed entries, which refer back to this
+        // directory, so it can be freed. Refuses, returning false, while anything outside this
+        // directory still refers to it, its entries or its loaded files and subdirectories.
+        // Called on evicted directories with the file system lock held exclusively.
+        bool release();
+
     private:
+        // Rough heap cost of one parsed entry: the raw entry, the long name entry and its
+        // index nodes
+        static constexpr std::int64_t ENTRY_MEMORY = 256;
+
         std::set<std::string> usedAkaiNames;
         std::shared_ptr<Fat> fat;
-        std::map<std::shared_ptr<FatDirectoryEntry>, std::shared_ptr<FatFile>> entryToFile;
-        std::map<std::shared_ptr<FatDirectoryEntry>, std::shared_ptr<AkaiFatLfnDirectory>> entryToDirectory;
+        // Loaded files and subdirectories. The object cache of the file system keeps the recently
+        // used ones alive, callers keep the others.
+        std::map<std::shared_ptr<FatDirectoryEntry>, std::weak_ptr<FatFile>> entryToFile;
+        std::map<std::shared_ptr<FatDirectoryEntry>, std::weak_ptr<AkaiFatLfnDirectory>> entryToDirectory;
+        // Readers share the directory lock and may fill the two maps above concurrently
+        std::mutex cacheMutex;
+        util::ReentrantSharedMutex lock;
+
+        std::shared_ptr<util::BlockPool> entryPool = std::make_shared<util::BlockPool>();
+        std::atomic<std::uint64_t> generation{0};
+        // Only accessed through std::atomic_load and std::atomic_store
+        std::shared_ptr<const Snapshot> snapshot;
+        // Changed since the last flush
+        bool dirty = false;
+        std::int32_t batchDepth = 0;
+        std::int32_t batchSlots = 0;
+
+        bool isInBatch() const;
+
+        bool hasUnflushedChanges();
+
+        // True if more than holders, the entries of this directory, or the index and the
+        // published snapshot refer to this directory and its entries. The caller holds getLock()
+        // or the file system lock exclusively.
+        bool isReferencedOutside(long holders);
+
+        // Estimated memory, charged to the object cache
+        std::int64_t getCacheCost() const;
+
+        // Bumps the generation and counts the change towards the dirty bytes of the file system
+        void changed();
+
+        std::int32_t getCompactSize();
+
+        void reserveSlots(std::int32_t count);
+
+        void collectChains(const std::shared_ptr<AkaiFatLfnDirectoryEntry> &entry, std::vector<std::int64_t> &startClusters);
+
+        void removeEntries(const std::vector<std::shared_ptr<AkaiFatLfnDirectoryEntry>> &toRemove);
 
         void checkUniqueName(std::string &name);
 
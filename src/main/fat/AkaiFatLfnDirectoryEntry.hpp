@@ -18,9 +18,17 @@
 namespace akaifat::fat {
     class AkaiFatLfnDirectoryEntry : public akaifat::AbstractFsObject, public akaifat::FsDirectoryEntry {
 
+        // publishSnapshot() reads fileName without taking the locks getName() takes
+        friend class AkaiFatLfnDirectory;
+
     private:
         std::shared_ptr<AkaiFatLfnDirectory> parent;
         std::string fileName;
+
+        // LFN slots last produced by appendCompactForm(), and the name and checksum they encode
+        std::vector<std::shared_ptr<FatDirectoryEntry>> lfnParts;
+        std::string lfnPartsName;
+        char lfnPartsCheckSum = 0;
         
         size_t totalEntrySize() {
             size_t result = (fileName.length() / 13) + 1;
@@ -29,12 +37,11 @@ namespace akaifat::fat {
         }
 
         static std::shared_ptr<FatDirectoryEntry> createPart(const std::string& subName,
-                std::int32_t ordinal, char checkSum, bool isLast) {
+                std::int32_t ordinal, char checkSum, bool isLast, const std::shared_ptr<util::BlockPool> &entryPool) {
                 
             char unicodechar[13];
 
-            const char* unicodechar1 = subName.c_str();
-            for (std::int32_t i = 0; i < 13; i++) unicodechar[i] = unicodechar1[i];
+            for (size_t i = 0; i < 13 && i < subName.length(); i++) unicodechar[i] = subName[i];
             
             for (auto i=subName.length(); i < 13; i++) {
                 if (i==subName.length()) {
@@ -44,7 +51,7 @@ namespace akaifat::fat {
                 }
             }
 
-            std::vector<char> rawData(FatDirectoryEntry::SIZE);
+            std::array<char, FatDirectoryEntry::SIZE> rawData{};
             
             if (isLast) {
                 LittleEndian::setInt8(rawData, 0, ordinal + (1 << 6));
@@ -71,7 +78,28 @@ namespace akaifat::fat {
             LittleEndian::setInt16(rawData, 28, static_cast<unsigned char>(unicodechar[11]));
             LittleEndian::setInt16(rawData, 30, static_cast<unsigned char>(unicodechar[12]));
             
-            return std::make_shared<FatDirectoryEntry>(rawData, false);
+            return std::allocate_shared<FatDirectoryEntry>(
+                    util::PoolAllocator<FatDirectoryEntry>(entryPool), rawData, false);
+        }
+
+        void rebuildLfnParts(char checkSum) {
+            const auto entrySize = totalEntrySize();
+            auto entryPool = parent->dir->getEntryPool();
+
+            lfnParts.resize(entrySize - 1);
+
+            std::int32_t j = 0;
+
+            for (size_t i = entrySize - 2; i > 0; i--)
+            {
+                lfnParts[i] = createPart(fileName.substr(j * 13, 13), j + 1, checkSum, false, entryPool);
+                j++;
+            }
+
+            lfnParts[0] = createPart(fileName.substr(j * 13), j + 1, checkSum, true, entryPool);
+
+            lfnPartsName = fileName;
+            lfnPartsCheckSum = checkSum;
         }
         
     public:
@@ -99,8 +127,9 @@ namespace akaifat::fat {
                 // Every single-length entry is treated like an Akai 16.3 FAT16 entry
                 std::string shortName = realEntry->getShortName().asSimpleString();
                 std::string akaiPart = AkaiStrUtil::trim_copy(AkaiPart::parse(realEntry->data).asSimpleString());
-                std::string part1 = AkaiStrUtil::trim_copy(AkaiFatLfnDirectory::splitName(shortName)[0]);
-                std::string ext = AkaiStrUtil::trim_copy(AkaiFatLfnDirectory::splitName(shortName)[1]);
+                auto dot = (shortName == "." || shortName == "..") ? std::string::npos : shortName.find_last_of('.');
+                std::string part1 = AkaiStrUtil::trim_copy(shortName.substr(0, dot));
+                std::string ext = dot == std::string::npos ? "" : AkaiStrUtil::trim_copy(shortName.substr(dot + 1));
 
                 if (ext.length() > 0) ext = "." + ext;
 
@@ -118,7 +147,8 @@ namespace akaifat::fat {
                 fileName = AkaiStrUtil::trim(name);
             }
 
-            return std::make_shared<AkaiFatLfnDirectoryEntry>(dir, realEntry, fileName);
+            return std::allocate_shared<AkaiFatLfnDirectoryEntry>(
+                    util::PoolAllocator<AkaiFatLfnDirectoryEntry>(dir->getEntryPool()), dir, realEntry, fileName);
         }
 
         bool isHiddenFlag() {
@@ -159,6 +189,8 @@ namespace akaifat::fat {
 
         std::string getName() override {
             checkValid();
+            util::ReadLock fsLock(parent->getFat()->getLock());
+            util::ReadLock dirLock(parent->getLock());
 
             return fileName;
         }
@@ -198,6 +230,8 @@ namespace akaifat::fat {
 
         void setName(std::string newName) override {
             checkWritable();
+            util::ReadLock fsLock(parent->getFat()->getLock());
+            util::WriteLock dirLock(parent->getLock());
 
             if (!parent->isFreeName(newName)) {
                 throw std::runtime_error("the name \"" + newName + "\" is already in use");
@@ -213,6 +247,8 @@ namespace akaifat::fat {
         void moveTo(const std::shared_ptr<AkaiFatLfnDirectory>& target, std::string newName) {
 
             checkWritable();
+            // Spans two directories
+            util::WriteLock fsLock(parent->getFat()->getLock());
 
             if (!target->isFreeName(newName)) {
                 throw std::runtime_error("the name \"" + newName + "\" is already in use");
@@ -221,6 +257,7 @@ namespace akaifat::fat {
             auto entryName = getName();
 
             auto unlinkedEntryRef = parent->unlinkEntry(entryName, isFile(), realEntry);
+            parent->publishSnapshot();
             parent = target;
             fileName = newName;
             parent->linkEntry(unlinkedEntryRef);
@@ -247,46 +284,52 @@ namespace akaifat::fat {
         }
 
         std::shared_ptr<FatDirectoryEntry> realEntry;
-        
+
+        // Number of directory slots compactForm() will produce, without building them
+        std::int32_t compactSize() {
+            auto sn = realEntry->getShortName();
+
+            if (sn.equals(ShortName::DOT()) || sn.equals(ShortName::DOT_DOT()))
+                return 1;
+
+            if (ShortName::canConvert(fileName) && ShortName::get(fileName).asSimpleString() == fileName)
+                return 1;
+
+            return static_cast<std::int32_t>(totalEntrySize());
+        }
+
         std::vector<std::shared_ptr<FatDirectoryEntry>> compactForm() {
             std::vector<std::shared_ptr<FatDirectoryEntry>> result;
-            
+            appendCompactForm(result);
+            return result;
+        }
+
+        // Appends the LFN slots followed by the real entry. The LFN slots are only rebuilt
+        // when the name or short name checksum changed since the previous call.
+        void appendCompactForm(std::vector<std::shared_ptr<FatDirectoryEntry>> &dest) {
             auto sn = realEntry->getShortName();
             
             if (sn.equals(ShortName::DOT()) || sn.equals(ShortName::DOT_DOT()))
             {
-                result.push_back(realEntry);
-                return result;
+                dest.push_back(realEntry);
+                return;
             }
             
             if (ShortName::canConvert(fileName) && ShortName::get(fileName).asSimpleString() == fileName)
             {
                 auto sn2 = ShortName::get(fileName);
                 realEntry->setShortName(sn2);
-                result.push_back(realEntry);
-                return result;
+                dest.push_back(realEntry);
+                return;
             }
             
-            const auto entrySize = static_cast<size_t>(totalEntrySize());
-            
-            result.resize(entrySize);
-            
-            const char checkSum = realEntry->getShortName().checkSum();
-            
-            std::int32_t j = 0;
-            
-            for (size_t i = entrySize - 2; i > 0; i--)
-            {
-                result[i] = createPart(fileName.substr(j * 13, j * 13 + 13), j  + 1, checkSum, false);
-                j++;
-            }
-            
-            result[0] = createPart(fileName.substr(j * 13),
-                    j + 1, checkSum, true);
-            
-            result[entrySize - 1] = realEntry;
-            
-            return result;
+            const char checkSum = sn.checkSum();
+
+            if (lfnParts.empty() || lfnPartsCheckSum != checkSum || lfnPartsName != fileName)
+                rebuildLfnParts(checkSum);
+
+            dest.insert(end(dest), begin(lfnParts), end(lfnParts));
+            dest.push_back(realEntry);
         }
     };
 }
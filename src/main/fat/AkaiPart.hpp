@@ -4,6 +4,7 @@
 
 #include "util/string_util.hpp"
 
+#include <array>
 #include <string>
 #include <utility>
 #include <vector>
@@ -23,7 +24,7 @@ namespace akaifat::fat {
 
         static const char ASCII_SPACE = 0x20;
 
-        std::vector<char> nameBytes;
+        std::array<char, 8> nameBytes{};
 
     public:
         static std::vector<std::string> validChars_;
@@ -42,8 +43,9 @@ namespace akaifat::fat {
             return AkaiPart(std::move(name));
         }
 
-        static AkaiPart parse(std::vector<char> &data) {
-            std::vector<char> nameArr(8);
+        template <typename Bytes>
+        static AkaiPart parse(const Bytes &data) {
+            std::array<char, 8> nameArr{};
 
             for (std::int32_t i = 0; i < nameArr.size(); i++) {
                 nameArr[i] = (char) LittleEndian::getUInt8(data, i + 12);
@@ -53,7 +55,8 @@ namespace akaifat::fat {
             return AkaiPart(akaiPart);
         }
 
-        void write(std::vector<char> &dest) {
+        template <typename Bytes>
+        void write(Bytes &dest) {
             for (std::int32_t i = 0; i < nameBytes.size(); i++)
                 dest[i + 12] = nameBytes[i];
         }
@@ -63,7 +66,7 @@ namespace akaifat::fat {
             return AkaiStrUtil::trim(res);
         }
 
-        static void checkValidChars(const std::vector<char> &chars) {
+        static void checkValidChars(const std::array<char, 8> &chars) {
             for (std::int32_t i = 0; i < chars.size(); i++) {
                 if ((chars[i] & 0xff) != chars[i])
                     throw std::runtime_error("multi-byte character at " + std::to_string(i));
@@ -88,17 +91,17 @@ namespace akaifat::fat {
     private:
         static bool isValid(char c) {
 
-            for (auto s : validChars())
+            for (const auto &s : validChars())
                 if (s[0] == c)
                     return true;
 
             return false;
         }
 
-        static std::vector<char> toCharArray(std::string &name) {
+        static std::array<char, 8> toCharArray(std::string &name) {
             checkValidName(name);
 
-            std::vector<char> result(8);
+            std::array<char, 8> result{};
             for (std::int32_t i = 0; i < 8; i++)
                 result[i] = ASCII_SPACE;
 
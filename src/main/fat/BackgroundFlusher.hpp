@@ -0,0 +1,219 @@
+#pragma once
+
+#include "AkaiFatFileSystem.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+namespace akaifat::fat {
+
+/*
+ * Flushes a file system on a background thread, so callers do not pay for writing the FAT
+ * and directories. A flush starts when changes have been pending for longer than the
+ * maximum dirty age, when the dirty bytes reach a threshold, or when commit() is called.
+ * The dirty age bounds how much work a power loss can take.
+ *
+ * The file system must outlive the flusher.
+ */
+class BackgroundFlusher {
+public:
+    enum class Durability {
+        // Flushes hand the data to the device, which decides when it reaches the medium
+        NoSync,
+        // Every flush is followed by a device sync
+        SyncEachFlush,
+        // Like SyncEachFlush, but commit() calls that arrive within the group commit window
+        // share one flush and sync
+        GroupCommit
+    };
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    AkaiFatFileSystem *fs;
+    std::shared_ptr<BlockDevice> device;
+
+    Durability durability = Durability::SyncEachFlush;
+    std::chrono::milliseconds maxDirtyAge{5000};
+    std::int64_t dirtyBytesThreshold = 4 * 1024 * 1024;
+    std::chrono::milliseconds groupCommitWindow{10};
+    std::chrono::milliseconds pollInterval{20};
+
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable committed;
+    bool stopping = false;
+    // commit() calls get consecutive tickets. A ticket is done once a flush that started
+    // after it was taken has completed.
+    std::uint64_t commitsRequested = 0;
+    std::uint64_t commitsDone = 0;
+    // Error of the most recent flush, null if it succeeded
+    std::exception_ptr error;
+
+    std::uint64_t flushCount = 0;
+    std::uint64_t syncCount = 0;
+
+    void flushNow(bool sync) {
+        fs->flush();
+        device->flush();
+
+        if (!sync) return;
+
+        // Flushed but not durable, which the policy asked for
+        if (!device->canSync()) throw std::runtime_error("device cannot sync, use Durability::NoSync");
+
+        device->sync();
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        bool dirty = false;
+        Clock::time_point dirtySince;
+
+        while (true) {
+            wake.wait_for(lock, pollInterval, [this] { return stopping || commitsRequested != commitsDone; });
+
+            bool commitPending = commitsRequested != commitsDone;
+
+            // Give other committers the chance to join this flush
+            if (commitPending && durability == Durability::GroupCommit && !stopping)
+                wake.wait_for(lock, groupCommitWindow, [this] { return stopping; });
+
+            const auto dirtyBytes = fs->getDirtyBytes();
+            const auto now = Clock::now();
+
+            if (dirtyBytes > 0 && !dirty) {
+                dirty = true;
+                dirtySince = now;
+            }
+
+            const bool due = commitPending || stopping || dirtyBytes >= dirtyBytesThreshold ||
+                             (dirty && now - dirtySince >= maxDirtyAge);
+
+            if (due && (dirty || commitPending)) {
+                const auto ticket = commitsRequested;
+                const bool sync = durability != Durability::NoSync;
+                std::exception_ptr flushError;
+
+                lock.unlock();
+
+                try {
+                    flushNow(sync);
+                } catch (...) {
+                    flushError = std::current_exception();
+                }
+
+                lock.lock();
+
+                error = flushError;
+                flushCount++;
+                if (sync && !flushError) syncCount++;
+                commitsDone = ticket;
+                dirty = false;
+                committed.notify_all();
+            }
+
+            if (stopping) break;
+        }
+    }
+
+public:
+    explicit BackgroundFlusher(AkaiFatFileSystem *_fs)
+    : fs(_fs), device(_fs->getBootSector()->getDevice()) {}
+
+    BackgroundFlusher(const BackgroundFlusher &) = delete;
+    BackgroundFlusher &operator=(const BackgroundFlusher &) = delete;
+
+    // Flushes what is left
+    ~BackgroundFlusher() {
+        stop();
+    }
+
+    // SyncEachFlush and GroupCommit need a device that can sync, see BlockDevice::canSync().
+    // On other devices every flush still happens but reports an error.
+    void setDurability(Durability newDurability) {
+        std::lock_guard<std::mutex> guard(mutex);
+        durability = newDurability;
+    }
+
+    // Upper bound of the time changes stay unflushed
+    void setMaxDirtyAge(std::chrono::milliseconds age) {
+        std::lock_guard<std::mutex> guard(mutex);
+        maxDirtyAge = age;
+        pollInterval = std::min(pollInterval, std::max(age, std::chrono::milliseconds(1)));
+    }
+
+    // Flush as soon as this many bytes are dirty
+    void setDirtyBytesThreshold(std::int64_t bytes) {
+        std::lock_guard<std::mutex> guard(mutex);
+        dirtyBytesThreshold = bytes;
+    }
+
+    // How long a group commit waits for more commit() calls before it flushes
+    void setGroupCommitWindow(std::chrono::milliseconds window) {
+        std::lock_guard<std::mutex> guard(mutex);
+        groupCommitWindow = window;
+    }
+
+    void start() {
+        std::lock_guard<std::mutex> guard(mutex);
+
+        if (thread.joinable()) return;
+
+        stopping = false;
+        thread = std::thread([this] { run(); });
+    }
+
+    // Flushes what is pending, with a sync unless the policy is NoSync, and stops the thread
+    void stop() {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+
+            if (!thread.joinable()) return;
+
+            stopping = true;
+        }
+
+        wake.notify_all();
+        thread.join();
+    }
+
+    // Blocks until everything written before the call is flushed, and synced unless the
+    // policy is NoSync. Rethrows the error if that flush failed.
+    void commit() {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        if (!thread.joinable()) throw std::runtime_error("flusher is not running");
+
+        const auto ticket = ++commitsRequested;
+        wake.notify_all();
+        committed.wait(lock, [&] { return commitsDone >= ticket; });
+
+        if (error) std::rethrow_exception(error);
+    }
+
+    std::uint64_t getFlushCount() {
+        std::lock_guard<std::mutex> guard(mutex);
+        return flushCount;
+    }
+
+    std::uint64_t getSyncCount() {
+        std::lock_guard<std::mutex> guard(mutex);
+        return syncCount;
+    }
+
+    // The error of the most recent flush, null if it succeeded
+    std::exception_ptr getError() {
+        std::lock_guard<std::mutex> guard(mutex);
+        return error;
+    }
+};
+}
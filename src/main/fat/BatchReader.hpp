@@ -0,0 +1,144 @@
+#pragma once
+
+#include "FatFile.hpp"
+#include "ClusterChain.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace akaifat::fat {
+
+/*
+ * Collects reads from any number of files and executes them in one elevator sweep.
+ * Every request is resolved to its device extents. The extents are sorted by device offset,
+ * and neighbours that are at most maxGap bytes apart are read with a single device call.
+ *
+ * Files must not be written between add() and execute().
+ */
+class BatchReader {
+public:
+    struct Request {
+        std::shared_ptr<FatFile> file;
+        std::int64_t offset;
+        std::int64_t length;
+        char *dest;
+    };
+
+private:
+    struct Piece {
+        BlockDevice *device;
+        std::int64_t devOffset;
+        std::int64_t length;
+        char *dest;
+    };
+
+    std::vector<Request> requests;
+    std::int64_t maxGap = 64 * 1024;
+    std::int64_t maxMerged = 1024 * 1024;
+
+    std::vector<Piece> resolve() {
+        std::vector<Piece> pieces;
+
+        for (auto &request : requests) {
+            if (request.offset < 0 || request.offset + request.length > request.file->getLength())
+                throw std::runtime_error("EOF");
+
+            auto &chain = request.file->getChain();
+            auto dest = request.dest;
+
+            for (auto &extent : chain.getExtents(request.offset, request.length)) {
+                pieces.push_back({chain.getDevice().get(), extent.devOffset, extent.length, dest});
+                dest += extent.length;
+            }
+        }
+
+        std::sort(begin(pieces), end(pieces), [](const Piece &a, const Piece &b) {
+            if (a.device != b.device) return a.device < b.device;
+            return a.devOffset < b.devOffset;
+        });
+
+        return pieces;
+    }
+
+public:
+    void add(std::shared_ptr<FatFile> file, std::int64_t offset, std::int64_t length, char *dest) {
+        if (length > 0)
+            requests.push_back({std::move(file), offset, length, dest});
+    }
+
+    std::size_t size() const {
+        return requests.size();
+    }
+
+    // Extents this close together are read as one, the gap is read and dropped
+    void setMaxGap(std::int64_t bytes) {
+        maxGap = std::max<std::int64_t>(bytes, 0);
+    }
+
+    // Upper bound of a merged read, which goes through a scratch buffer of that size
+    void setMaxMerged(std::int64_t bytes) {
+        maxMerged = std::max<std::int64_t>(bytes, 1);
+    }
+
+    // Reads everything that was added and empties the batch. The batch is emptied even
+    // if a read fails.
+    void execute() {
+        std::vector<util::ReadLock> locks;
+        std::vector<Piece> pieces;
+
+        // One lock per file system involved, then one per file, so no file changes while
+        // the batch runs
+        auto lockOnce = [&locks](util::ReentrantSharedMutex &lock) {
+            if (std::none_of(begin(locks), end(locks), [&](const util::ReadLock &l) { return l.mutex() == &lock; }))
+                locks.emplace_back(lock);
+        };
+
+        for (auto &request : requests)
+            lockOnce(request.file->getChain().getFat()->getLock());
+
+        for (auto &request : requests)
+            lockOnce(request.file->getLock());
+
+        try {
+            pieces = resolve();
+        } catch (...) {
+            requests.clear();
+            throw;
+        }
+
+        requests.clear();
+
+        std::vector<char> scratch;
+        size_t i = 0;
+
+        while (i < pieces.size()) {
+            auto &first = pieces[i];
+            auto end = first.devOffset + first.length;
+            size_t j = i + 1;
+
+            while (j < pieces.size() && pieces[j].device == first.device &&
+                   pieces[j].devOffset <= end + maxGap &&
+                   std::max(end, pieces[j].devOffset + pieces[j].length) - first.devOffset <= maxMerged) {
+                end = std::max(end, pieces[j].devOffset + pieces[j].length);
+                j++;
+            }
+
+            if (j == i + 1) {
+                first.device->read(first.devOffset, first.dest, first.length);
+            } else {
+                scratch.resize(end - first.devOffset);
+                first.device->read(first.devOffset, scratch.data(), scratch.size());
+
+                for (size_t k = i; k < j; k++) {
+                    auto from = scratch.data() + (pieces[k].devOffset - first.devOffset);
+                    std::copy_n(from, pieces[k].length, pieces[k].dest);
+                }
+            }
+
+            i = j;
+        }
+    }
+};
+}
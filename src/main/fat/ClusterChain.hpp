@@ -95,12 +95,7 @@ namespace akaifat::fat {
                 if (nrClusters != chain.size()) {
                     if (nrClusters > chain.size()) {
                         /* grow the chain */
-                        std::int32_t count = nrClusters - chain.size();
-
-                        while (count > 0) {
-                            fat->allocAppend(getStartCluster());
-                            count--;
-                        }
+                        fat->allocAppendToTail(chain.back(), nrClusters - chain.size());
                     } else {
                         /* shrink the chain */
                         if (nrClusters > 0) {
@@ -120,78 +115,123 @@ namespace akaifat::fat {
             }
         }
 
+        // Adds nrClusters clusters after tailCluster, or starts the chain if it is empty.
+        // Returns the new clusters.
+        std::vector<std::int64_t> appendClusters(std::int64_t tailCluster, std::int32_t nrClusters) {
+            if (nrClusters <= 0) return {};
+
+            if (startCluster == 0) {
+                auto chain = fat->allocNew(nrClusters);
+                startCluster = chain[0];
+                return chain;
+            }
+
+            return fat->allocAppendToTail(tailCluster, nrClusters);
+        }
+
         void readData(std::int64_t offset, ByteBuffer &dest) {
+            const auto len = dest.remaining();
+            readData(offset, dest.getBuffer().data() + dest.position(), len);
+            dest.position(dest.position() + len);
+        }
 
-            std::int32_t len = (std::int32_t) dest.remaining();
+        void writeData(std::int64_t offset, ByteBuffer &srcBuf) {
+            const auto len = srcBuf.remaining();
+            writeData(offset, srcBuf.getBuffer().data() + srcBuf.position(), len);
+            srcBuf.position(srcBuf.position() + len);
+        }
 
-            if (startCluster == 0 && len > 0) {
+        // Runs of physically consecutive clusters are transferred with a single device read
+        void readData(std::int64_t offset, char *dest, std::int64_t len) {
+            if (len == 0) return;
+
+            util::TraceScope trace("ClusterChain::readData", offset, len);
+
+            if (startCluster == 0) {
                 throw std::runtime_error("cannot read from empty cluster chain");
             }
 
             auto chain = getFat()->getChain(startCluster);
-            auto dev = getDevice();
 
-            auto chainIdx = (std::int32_t) (offset / clusterSize);
+            forEachRun(chain, offset, len, [&](std::int64_t devOffset, std::int64_t size) {
+                device->read(devOffset, dest, size);
+                dest += size;
+            });
+        }
 
-            if (offset % clusterSize != 0) {
-                auto clusOfs = (std::int32_t) (offset % clusterSize);
-                std::int32_t size = std::min<int>(len,  clusterSize - (offset % clusterSize));
-                dest.limit(dest.position() + size);
+        void writeData(std::int64_t offset, const char *src, std::int64_t len) {
+            if (len == 0) return;
 
-                dev->read(getDevOffset(chain[chainIdx], clusOfs), dest);
+            util::TraceScope trace("ClusterChain::writeData", offset, len);
 
-                len -= size;
-                chainIdx++;
+            std::int64_t minSize = offset + len;
+            if (getLengthOnDisk() < minSize) {
+                setSize(minSize);
             }
 
-            while (len > 0) {
-                std::int32_t size = std::min<int>(clusterSize, len);
-                dest.limit(dest.position() + size);
+            writeData(fat->getChain(getStartCluster()), offset, src, len);
+        }
 
-                dev->read(getDevOffset(chain[chainIdx], 0), dest);
+        // Contiguous range on the device
+        struct Extent {
+            std::int64_t devOffset;
+            std::int64_t length;
+        };
 
-                len -= size;
-                chainIdx++;
-            }
-        }
+        // The device ranges behind [offset, offset + len), in file order
+        std::vector<Extent> getExtents(std::int64_t offset, std::int64_t len) {
+            std::vector<Extent> result;
 
-        void writeData(std::int64_t offset, ByteBuffer &srcBuf) {
+            if (len == 0) return result;
 
-            std::int32_t len = srcBuf.remaining();
+            if (startCluster == 0 || offset + len > getLengthOnDisk())
+                throw std::runtime_error("range is beyond the end of the cluster chain");
 
-            if (len == 0) return;
+            forEachRun(fat->getChain(startCluster), offset, len, [&](std::int64_t devOffset, std::int64_t size) {
+                result.push_back({devOffset, size});
+            });
 
-            std::int64_t minSize = offset + len;
-            if (getLengthOnDisk() < minSize) {
-                setSize(minSize);
-            }
+            return result;
+        }
 
-            auto chain = fat->getChain(getStartCluster());
+        // Passes the device ranges behind [offset, offset + len) to BlockDevice::willNeed
+        void willNeed(std::int64_t offset, std::int64_t len) {
+            if (len == 0 || startCluster == 0) return;
 
-            auto chainIdx = (std::int32_t) (offset / clusterSize);
+            forEachRun(fat->getChain(startCluster), offset, len, [&](std::int64_t devOffset, std::int64_t size) {
+                device->willNeed(devOffset, size);
+            });
+        }
 
-            if (offset % clusterSize != 0) {
-                auto clusOfs = (std::int32_t) (offset % clusterSize);
-                std::int32_t size = std::min<int>(len,
-                                    (std::int32_t) (clusterSize - (offset % clusterSize)));
-                srcBuf.limit(srcBuf.position() + size);
+        // Writes through clusters the caller already looked up. They must cover offset + len.
+        void writeData(const std::vector<std::int64_t> &chain, std::int64_t offset, const char *src, std::int64_t len) {
+            forEachRun(chain, offset, len, [&](std::int64_t devOffset, std::int64_t size) {
+                device->write(devOffset, src, size);
+                src += size;
+            });
+        }
 
-                device->write(getDevOffset(chain[chainIdx], clusOfs), srcBuf);
+    private:
+        template <typename F>
+        void forEachRun(const std::vector<std::int64_t> &chain, std::int64_t offset, std::int64_t len, F &&f) {
+            auto chainIdx = static_cast<size_t>(offset / clusterSize);
+            auto clusOfs = static_cast<std::int32_t>(offset % clusterSize);
 
-                len -= size;
+            while (len > 0) {
+                auto devOffset = getDevOffset(chain[chainIdx], clusOfs);
+                std::int64_t size = std::min<std::int64_t>(clusterSize - clusOfs, len);
                 chainIdx++;
-            }
 
-            while (len > 0) {
-                std::int32_t size = std::min<int>(clusterSize, len);
-                srcBuf.limit(srcBuf.position() + size);
+                while (size < len && chainIdx < chain.size() && chain[chainIdx] == chain[chainIdx - 1] + 1) {
+                    size += std::min<std::int64_t>(clusterSize, len - size);
+                    chainIdx++;
+                }
 
-                device->write(getDevOffset(chain[chainIdx], 0), srcBuf);
+                f(devOffset, size);
 
                 len -= size;
-                chainIdx++;
+                clusOfs = 0;
             }
-
         }
     };
 }
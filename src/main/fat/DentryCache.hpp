@@ -0,0 +1,125 @@
+#pragma once
+
+#include "AkaiFatLfnDirectory.hpp"
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace akaifat::fat {
+
+class AkaiFatLfnDirectoryEntry;
+
+/*
+ * Bounded LRU cache of resolved paths, including paths that did not resolve.
+ * Every cached path remembers the generation of each directory it was looked up in.
+ * Adding, renaming, moving or removing an entry bumps the generation of the directories
+ * involved, so a lookup through any of them is treated as a miss afterwards.
+ */
+class DentryCache {
+public:
+    // Rough heap cost of one cached path
+    static constexpr std::int64_t DENTRY_MEMORY = 256;
+
+    struct Step {
+        std::weak_ptr<AkaiFatLfnDirectory> directory;
+        std::uint64_t generation;
+    };
+
+    struct Dentry {
+        // Weak, so cached paths do not keep evicted directories loaded
+        std::weak_ptr<AkaiFatLfnDirectoryEntry> entry;
+        // Set for a path that did not resolve
+        bool negative = false;
+        std::vector<Step> steps;
+    };
+
+private:
+    using LruList = std::list<std::pair<std::string, Dentry>>;
+
+    std::size_t capacity;
+    LruList lru;
+    std::unordered_map<std::string, LruList::iterator> index;
+
+    static bool isCurrent(const Dentry &dentry) {
+        for (auto &step : dentry.steps) {
+            auto directory = step.directory.lock();
+
+            if (!directory || !directory->isValid() || directory->getGeneration() != step.generation)
+                return false;
+        }
+
+        return true;
+    }
+
+public:
+    explicit DentryCache(std::size_t _capacity) : capacity(_capacity) {}
+
+    // Returns true on a hit. result is nullptr for a cached negative entry.
+    bool lookup(const std::string &key, std::shared_ptr<AkaiFatLfnDirectoryEntry> &result) {
+        auto it = index.find(key);
+
+        if (it == end(index)) return false;
+
+        if (!isCurrent(it->second->second)) {
+            lru.erase(it->second);
+            index.erase(it);
+            return false;
+        }
+
+        auto &dentry = it->second->second;
+        result = dentry.entry.lock();
+
+        if (!result && !dentry.negative) {
+            lru.erase(it->second);
+            index.erase(it);
+            return false;
+        }
+
+        lru.splice(begin(lru), lru, it->second);
+        return true;
+    }
+
+    void insert(const std::string &key, Dentry dentry) {
+        if (capacity == 0) return;
+
+        auto it = index.find(key);
+
+        if (it != end(index)) {
+            it->second->second = std::move(dentry);
+            lru.splice(begin(lru), lru, it->second);
+            return;
+        }
+
+        lru.emplace_front(key, std::move(dentry));
+        index[key] = begin(lru);
+
+        while (lru.size() > capacity) {
+            index.erase(lru.back().first);
+            lru.pop_back();
+        }
+    }
+
+    void setCapacity(std::size_t newCapacity) {
+        capacity = newCapacity;
+
+        while (lru.size() > capacity) {
+            index.erase(lru.back().first);
+            lru.pop_back();
+        }
+    }
+
+    std::size_t size() const {
+        return lru.size();
+    }
+
+    void clear() {
+        lru.clear();
+        index.clear();
+    }
+};
+}
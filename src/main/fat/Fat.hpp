@@ -2,8 +2,17 @@
 
 #include "BootSector.hpp"
 #include "FatType.hpp"
+#include "FileSystemStats.hpp"
+#include "ObjectCache.hpp"
 
+#include "../util/ReentrantSharedMutex.hpp"
+#include "../util/SerialQueue.hpp"
+#include "../util/Trace.hpp"
+
+#include <algorithm>
+#include <atomic>
 #include <memory>
+#include <mutex>
 #include <utility>
 #include <cstdint>
 
@@ -19,7 +28,38 @@ private:
     std::int32_t sectorSize;
     std::shared_ptr<BlockDevice> device;
     
-    std::int32_t lastAllocatedCluster;
+    // The cluster space is split into allocation groups, each with its own mutex, cursor and
+    // free count, so threads that allocate at the same time do not serialize on one cursor.
+    // A thread allocates from its home group and moves on to the next one when it is full.
+    struct AllocationGroup {
+        std::int32_t first = 0;
+        std::int32_t end = 0;
+        std::int32_t cursor = 0;
+        std::int32_t freeCount = 0;
+        std::mutex mutex;
+    };
+
+    static constexpr std::int32_t MIN_GROUP_SIZE = 256;
+    static constexpr std::int32_t MAX_GROUPS = 16;
+    static constexpr std::int64_t DEFAULT_OBJECT_CACHE_LIMIT = 64 * 1024 * 1024;
+
+    std::vector<AllocationGroup> groups;
+    std::int32_t groupSize;
+    std::atomic<std::int32_t> lastAllocatedCluster;
+
+    // Sectors of the FAT that changed since they were last written, and their number
+    std::vector<std::atomic<bool>> dirtySectors;
+    std::atomic<std::int32_t> dirtySectorCount{0};
+    // Bytes changed since the last flush, see addDirtyBytes()
+    std::atomic<std::int64_t> dirtyBytes{0};
+
+    util::ReentrantSharedMutex lock;
+
+    std::shared_ptr<ObjectCache> objectCache = std::make_shared<ObjectCache>(DEFAULT_OBJECT_CACHE_LIMIT);
+    std::shared_ptr<FileSystemStats> stats = std::make_shared<FileSystemStats>();
+
+    std::once_flag ioQueueCreated;
+    std::shared_ptr<util::SerialQueue> ioQueue;
 
     void init(std::int32_t mediumDescriptor) {
         entries[0] =
@@ -34,8 +74,109 @@ private:
 
         for (std::int32_t i = 0; i < entries.size(); i++)
             entries[i] = fatType->readEntry(bb.getBuffer(), i);
+
+        countFree();
+    }
+
+    void initGroups() {
+        const auto clusterCount = lastClusterIndex - FIRST_CLUSTER;
+        const auto groupCount = std::clamp(clusterCount / MIN_GROUP_SIZE, 1, MAX_GROUPS);
+        groupSize = (clusterCount + groupCount - 1) / groupCount;
+        groups = std::vector<AllocationGroup>(groupCount);
+
+        for (std::int32_t i = 0; i < groupCount; i++) {
+            auto &group = groups[i];
+            group.first = FIRST_CLUSTER + i * groupSize;
+            group.end = std::min(group.first + groupSize, lastClusterIndex);
+            group.cursor = group.first;
+        }
+    }
+
+    void countFree() {
+        for (auto &group : groups) {
+            std::lock_guard<std::mutex> guard(group.mutex);
+            group.freeCount = 0;
+
+            for (auto i = group.first; i < group.end; i++)
+                if (entries[i] == 0) group.freeCount++;
+        }
+    }
+
+    AllocationGroup &groupOf(std::int64_t cluster) {
+        auto index = (static_cast<std::int32_t>(cluster) - FIRST_CLUSTER) / groupSize;
+        return groups[std::min<std::size_t>(std::max(index, 0), groups.size() - 1)];
+    }
+
+    // Threads are spread round robin over the groups, in the order they first allocate
+    std::size_t getHomeGroup() {
+        static std::atomic<std::size_t> nextThread{0};
+        thread_local std::size_t thread = nextThread++;
+        return thread % groups.size();
+    }
+
+    void markSectorDirty(std::int64_t byteOffset) {
+        if (!dirtySectors[byteOffset / sectorSize].exchange(true))
+            dirtySectorCount++;
+    }
+
+    // The caller holds the mutex of the group the cluster belongs to
+    void setEntry(AllocationGroup &group, std::int64_t cluster, std::int64_t value) {
+        auto &entry = entries[(std::int32_t) cluster];
+
+        // FAT12 entries may straddle two sectors
+        markSectorDirty(static_cast<std::int64_t>(cluster * fatType->getEntrySize()));
+        markSectorDirty(static_cast<std::int64_t>((cluster + 1) * fatType->getEntrySize()) - 1);
+
+        if (cluster >= group.first && cluster < group.end) {
+            if (entry == 0 && value != 0) group.freeCount--;
+            else if (entry != 0 && value == 0) group.freeCount++;
+        }
+
+        entry = value;
+    }
+
+    void setEntry(std::int64_t cluster, std::int64_t value) {
+        auto &group = groupOf(cluster);
+        std::lock_guard<std::mutex> guard(group.mutex);
+        setEntry(group, cluster, value);
+    }
+
+    // Takes the first free cluster at or after the cursor, wrapping around within the group.
+    // Returns -1 if the group is full.
+    std::int64_t allocFrom(AllocationGroup &group) {
+        std::lock_guard<std::mutex> guard(group.mutex);
+
+        if (group.freeCount == 0) return -1;
+
+        auto cluster = group.cursor;
+
+        while (entries[cluster] != 0) {
+            if (++cluster == group.end) cluster = group.first;
+        }
+
+        setEntry(group, cluster, fatType->getEofMarker());
+        group.cursor = cluster;
+
+        return cluster;
     }
     
+    std::vector<char> encode() {
+        std::vector<char> data(sectorCount * sectorSize);
+
+        for (std::int32_t index = 0; index < entries.size(); index++) {
+            fatType->writeEntry(data, index, entries[index]);
+        }
+
+        return data;
+    }
+
+    void clearDirtySectors() {
+        for (auto &sector : dirtySectors)
+            sector = false;
+
+        dirtySectorCount = 0;
+    }
+
 public:
     static const std::int32_t FIRST_CLUSTER = 2;
 
@@ -74,10 +215,14 @@ public:
         if (lastClusterIndex > entries.size())
             throw std::runtime_error("file system has " + std::to_string(lastClusterIndex) +
                                      " clusters but only " + std::to_string(entries.size()) + " FAT entries");
+
+        initGroups();
+        dirtySectors = std::vector<std::atomic<bool>>(sectorCount);
     }
 
     static std::shared_ptr<Fat> read(std::shared_ptr<BootSector> bs, std::int32_t fatNr) {
-        
+        util::TraceScope trace("Fat::read");
+
         if (fatNr > bs->getNrFats()) {
             throw std::runtime_error("boot sector says there are only " + std::to_string(bs->getNrFats()) +
                     " FATs when reading FAT #" + std::to_string(fatNr));
@@ -103,6 +248,7 @@ public:
             throw std::runtime_error("FAT too small for device");
             
         result->init(bs->getMediumDescriptor());
+        result->countFree();
         result->write();
         return result;
     }
@@ -118,27 +264,125 @@ public:
     std::shared_ptr<BlockDevice> getDevice() {
         return device;
     }
+
+    // Taken shared by every operation on the file system, and exclusively by those that write
+    // metadata to the device or span directories, like flushing and moving entries. Directories
+    // and files have their own locks for everything else, which are taken after this one.
+    // Allocating and freeing clusters only needs it shared.
+    util::ReentrantSharedMutex &getLock() {
+        return lock;
+    }
+
+    FileSystemStats &getStats() {
+        return *stats;
+    }
+
+    // Shares the statistics of the file system. Only called before the FAT is used.
+    void setStats(std::shared_ptr<FileSystemStats> newStats) {
+        stats = std::move(newStats);
+    }
+
+    // Files and subdirectories of this file system that stay loaded
+    std::shared_ptr<ObjectCache> getObjectCache() {
+        return objectCache;
+    }
+
+    // Asynchronous I/O on this file system runs here, one operation at a time
+    std::shared_ptr<util::SerialQueue> getIoQueue() {
+        std::call_once(ioQueueCreated, [this] {
+            ioQueue = std::make_shared<util::SerialQueue>(util::getIoPool(), 64);
+        });
+
+        return ioQueue;
+    }
    
+    // Writing the FAT needs the file system lock held exclusively, so no clusters are
+    // allocated or freed meanwhile
     void write() {
         writeCopy(offset);
     }
     
     void writeCopy(std::int64_t _offset) {
-        std::vector<char> data(sectorCount * sectorSize);
-        
-        for (std::int32_t index = 0; index < entries.size(); index++) {
-            fatType->writeEntry(data, index, entries[index]);
-        }
-        
-        auto bb = ByteBuffer(data);
+        auto bb = ByteBuffer(encode());
         device->write(_offset, bb);
     }
+
+    void writeCopies() {
+        for (std::int32_t i = 0; i < bs->getNrFats(); i++) {
+            writeCopy(bs->getFatOffset(i));
+        }
+
+        clearDirtySectors();
+    }
+
+    // Writes only the sectors that changed since the FAT was last written, to every copy.
+    // Needs the file system lock held exclusively, like write().
+    void writeDirtyCopies() {
+        if (dirtySectorCount == 0) return;
+
+        const auto data = encode();
+
+        for (std::int32_t first = 0; first < sectorCount; first++) {
+            if (!dirtySectors[first]) continue;
+
+            auto last = first;
+
+            while (last + 1 < sectorCount && dirtySectors[last + 1]) last++;
+
+            const auto begin = static_cast<std::int64_t>(first) * sectorSize;
+            const auto length = static_cast<std::int64_t>(last - first + 1) * sectorSize;
+
+            for (std::int32_t i = 0; i < bs->getNrFats(); i++)
+                device->write(bs->getFatOffset(i) + begin, data.data() + begin, length);
+
+            first = last;
+        }
+
+        clearDirtySectors();
+    }
+
+    // Makes the next writeDirtyCopies() write the whole FAT, e.g. to bring copies that
+    // differ back in line
+    void markAllDirty() {
+        for (auto &sector : dirtySectors)
+            sector = true;
+
+        dirtySectorCount = sectorCount;
+    }
+
+    std::int32_t getDirtySectorCount() {
+        return dirtySectorCount;
+    }
+
+    // Counts bytes of file data or metadata changed in memory or handed to the device since
+    // the last flush, so write-back policies can tell how much work is at stake
+    void addDirtyBytes(std::int64_t bytes) {
+        dirtyBytes += bytes;
+    }
+
+    // Changed bytes since the last clearDirtyBytes(), including the dirty FAT sectors.
+    // Takes no locks.
+    std::int64_t getDirtyBytes() {
+        return dirtyBytes + static_cast<std::int64_t>(dirtySectorCount) * sectorSize;
+    }
+
+    // Heap use of the in-memory FAT and its bookkeeping
+    std::int64_t getMemoryUsage() {
+        return static_cast<std::int64_t>(entries.size() * sizeof(std::int64_t) +
+                                         dirtySectors.size() * sizeof(std::atomic<bool>) +
+                                         groups.size() * sizeof(AllocationGroup));
+    }
+
+    void clearDirtyBytes() {
+        dirtyBytes = 0;
+    }
     
     std::int32_t getMediumDescriptor() {
         return (std::int32_t) (entries[0] & 0xFF);
     }
     
     std::int64_t getEntry(std::int32_t index) {
+        stats->count(stats->fatLookups);
         return entries[index];
     }
 
@@ -147,6 +391,8 @@ public:
     }
     
     std::vector<std::int64_t> getChain(std::int64_t startCluster) {
+        ScopedLatency latency(*stats, stats->chainWalkLatency);
+        stats->count(stats->chainWalks);
         testCluster(startCluster);
         // Count the chain first
         std::int32_t count = 1;
@@ -168,6 +414,7 @@ public:
     }
 
     std::int64_t getNextCluster(std::int64_t cluster) {
+        stats->count(stats->fatLookups);
         testCluster(cluster);
         std::int64_t entry = entries[(std::int32_t) cluster];
         if (isEofCluster(entry)) {
@@ -178,44 +425,28 @@ public:
     }
 
     std::int64_t allocNew() {
+        ScopedLatency latency(*stats, stats->allocationLatency);
+        stats->count(stats->allocations);
+        const auto home = getHomeGroup();
 
-        std::int32_t i;
-        std::int32_t entryIndex = -1;
+        for (std::size_t i = 0; i < groups.size(); i++) {
+            auto cluster = allocFrom(groups[(home + i) % groups.size()]);
 
-        for (i = lastAllocatedCluster; i < lastClusterIndex; i++) {
-            if (isFreeCluster(i)) {
-                entryIndex = i;
-                break;
+            if (cluster >= 0) {
+                lastAllocatedCluster = static_cast<std::int32_t>(cluster);
+                return cluster;
             }
         }
-        
-        if (entryIndex < 0) {
-            for (i = FIRST_CLUSTER; i < lastAllocatedCluster; i++) {
-                if (isFreeCluster(i)) {
-                    entryIndex = i;
-                    break;
-                }
-            }
-        }
-        
-        if (entryIndex < 0) {
-            throw std::runtime_error("FAT Full (" + std::to_string(lastClusterIndex - FIRST_CLUSTER)
-                    + ", " + std::to_string(i) + ")");
-        }
-        
-        entries[entryIndex] = fatType->getEofMarker();
-        lastAllocatedCluster = entryIndex % lastClusterIndex;
-        if (lastAllocatedCluster < FIRST_CLUSTER)
-            lastAllocatedCluster = FIRST_CLUSTER;
-        
-        return entryIndex;
+
+        throw std::runtime_error("FAT Full (" + std::to_string(lastClusterIndex - FIRST_CLUSTER) + ")");
     }
     
     std::int32_t getFreeClusterCount() {
         std::int32_t result = 0;
 
-        for (std::int32_t i=FIRST_CLUSTER; i < lastClusterIndex; i++) {
-            if (isFreeCluster(i)) result++;
+        for (auto &group : groups) {
+            std::lock_guard<std::mutex> guard(group.mutex);
+            result += group.freeCount;
         }
 
         return result;
@@ -245,19 +476,66 @@ public:
         }
         
         std::int64_t newCluster = allocNew();
-        entries[(std::int32_t) cluster] = newCluster;
+        setEntry(cluster, newCluster);
 
         return newCluster;
     }
 
+    // Links nrClusters new clusters after tailCluster, which must end its chain. Unlike
+    // allocAppend this does not walk the chain, so the caller has to know its tail.
+    std::vector<std::int64_t> allocAppendToTail(std::int64_t tailCluster, std::int32_t nrClusters) {
+        testCluster(tailCluster);
+
+        if (!isEofCluster(entries[(std::int32_t) tailCluster]))
+            throw std::runtime_error("cluster " + std::to_string(tailCluster) + " does not end its chain");
+
+        std::vector<std::int64_t> rc(nrClusters);
+
+        for (std::int32_t i = 0; i < nrClusters; i++) {
+            rc[i] = allocNew();
+            setEntry(tailCluster, rc[i]);
+            tailCluster = rc[i];
+        }
+
+        return rc;
+    }
+
     void setEof(std::int64_t cluster) {
         testCluster(cluster);
-        entries[(std::int32_t) cluster] = fatType->getEofMarker();
+        setEntry(cluster, fatType->getEofMarker());
     }
 
     void setFree(std::int64_t cluster) {
         testCluster(cluster);
-        entries[(std::int32_t) cluster] = 0;
+        setEntry(cluster, 0);
+    }
+
+    // Frees all clusters of the given chains in one sweep, without building the chains first
+    void freeChains(const std::vector<std::int64_t> &startClusters) {
+        AllocationGroup *locked = nullptr;
+        std::unique_lock<std::mutex> guard;
+
+        for (auto cluster : startClusters) {
+            testCluster(cluster);
+
+            while (true) {
+                // Chains mostly stay within a group, so its mutex is kept until they leave it
+                auto &group = groupOf(cluster);
+
+                if (&group != locked) {
+                    guard = std::unique_lock<std::mutex>(group.mutex);
+                    locked = &group;
+                }
+
+                auto next = entries[(std::int32_t) cluster];
+                setEntry(group, cluster, 0);
+
+                if (next == 0 || isEofCluster(next)) break;
+
+                testCluster(next);
+                cluster = next;
+            }
+        }
     }
     
     bool equals(const std::shared_ptr<Fat>& other) {
@@ -300,6 +578,8 @@ public:
 
     bool isFreeCluster(std::int64_t entry) {
         if (entry > INT_MAX) throw std::runtime_error("entry is bigger than INT_MAX");
+        auto &group = groupOf(entry);
+        std::lock_guard<std::mutex> guard(group.mutex);
         return (entries[(std::int32_t) entry] == 0);
     }
     
@@ -4,9 +4,11 @@
 
 #include "AbstractDirectory.hpp"
 #include "../util/ByteBuffer.hpp"
+#include "../util/BlockPool.hpp"
 #include "LittleEndian.hpp"
 #include "ShortName.hpp"
 
+#include <array>
 #include <utility>
 #include <vector>
 #include <cassert>
@@ -28,12 +30,17 @@ namespace akaifat::fat {
         static const std::int32_t F_ARCHIVE = 0x20;
 
     public:
+        static std::int32_t const SIZE = 32;
+        static std::int32_t const ENTRY_DELETED_MAGIC = 0xe5;
+
+        std::array<char, SIZE> data{};
+
         explicit FatDirectoryEntry()
-                : FatDirectoryEntry(std::vector<char>(SIZE), false) {
+                : AbstractFsObject(false) {
         }
 
-        FatDirectoryEntry(std::vector<char> _data, bool readOnly)
-                : AbstractFsObject(readOnly), data(std::move(_data)) {
+        FatDirectoryEntry(const std::array<char, SIZE> &_data, bool readOnly)
+                : AbstractFsObject(readOnly), data(_data) {
         }
 
         void setFlag(std::int32_t mask, bool set) {
@@ -58,20 +65,26 @@ namespace akaifat::fat {
             LittleEndian::setInt8(data, OFFSET_ATTRIBUTES, flags);
         }
 
-        std::vector<char> data;
-
-        static std::int32_t const SIZE = 32;
-        static std::int32_t const ENTRY_DELETED_MAGIC = 0xe5;
-
         static std::shared_ptr<FatDirectoryEntry> read(ByteBuffer &buff, bool readOnly) {
+            return read(buff, readOnly, nullptr);
+        }
+
+        // Allocates the entry from entryPool when one is given
+        static std::shared_ptr<FatDirectoryEntry> read(ByteBuffer &buff, bool readOnly,
+                                                       const std::shared_ptr<util::BlockPool> &entryPool) {
 
             assert (buff.remaining() >= SIZE);
 
             if (buff.get(buff.position()) == 0)
                 return {};
 
-            std::vector<char> data(SIZE);
-            buff.get(data);
+            std::array<char, SIZE> data{};
+            buff.get(data.data(), SIZE);
+
+            if (entryPool)
+                return std::allocate_shared<FatDirectoryEntry>(
+                        util::PoolAllocator<FatDirectoryEntry>(entryPool), data, readOnly);
+
             return std::make_shared<FatDirectoryEntry>(data, readOnly);
         }
 
@@ -145,7 +158,7 @@ namespace akaifat::fat {
 
             assert(volumeLabel.length() != 0);
 
-            std::vector<char> data(SIZE);
+            std::array<char, SIZE> data{};
 
             for (std::int32_t i = 0; i < volumeLabel.length(); i++)
                 data[i] = volumeLabel[i];
@@ -184,6 +197,7 @@ namespace akaifat::fat {
 
         void setLength(std::int64_t length) {
             LittleEndian::setInt32(data, OFFSET_FILE_SIZE, length);
+            dirty = true;
         }
 
         ShortName getShortName() {
@@ -214,10 +228,11 @@ namespace akaifat::fat {
                 throw std::runtime_error("startCluster too big");
 
             LittleEndian::setInt16(data, 0x1a, (std::int32_t) startCluster);
+            dirty = true;
         }
 
         void write(ByteBuffer &buff) {
-            buff.put(data);
+            buff.put(data.data(), SIZE);
             dirty = false;
         }
 
@@ -248,7 +263,7 @@ namespace akaifat::fat {
                     end++;
                 }
                 
-                return std::string(unicodechar).substr(0, end);
+                return std::string(unicodechar, end);
             }
     };
 }
@@ -7,21 +7,399 @@
 #include "ClusterChain.hpp"
 #include "FatDirectoryEntry.hpp"
 
+#include <algorithm>
+#include <atomic>
 #include <exception>
+#include <functional>
+#include <future>
 #include <utility>
 #include <iostream>
+#include <mutex>
+#include <vector>
 
 namespace akaifat::fat {
 
-class FatFile : public akaifat::AbstractFsObject, public akaifat::FsFile {
+// Read-only memory of a range of a file on a mapped device, one span per extent. It keeps
+// the mapping alive, so the memory stays valid after the file system and the device are
+// closed. It only reflects later writes to clusters that still belong to the file.
+class FatFileView {
+public:
+    struct Span {
+        const char* data;
+        std::size_t size;
+    };
+
+private:
+    std::shared_ptr<const char> mapping;
+    std::vector<Span> spans;
+    std::size_t totalSize = 0;
+
+public:
+    FatFileView(std::shared_ptr<const char> _mapping, std::vector<Span> _spans)
+    : mapping(std::move(_mapping)), spans(std::move(_spans)) {
+        for (auto& span : spans) totalSize += span.size;
+    }
+
+    const std::vector<Span>& getSpans() const {
+        return spans;
+    }
+
+    bool isContiguous() const {
+        return spans.size() <= 1;
+    }
+
+    // Only for contiguous views
+    const char* data() const {
+        if (!isContiguous()) throw std::runtime_error("view is not contiguous");
+        return spans.empty() ? nullptr : spans[0].data;
+    }
+
+    std::size_t size() const {
+        return totalSize;
+    }
+};
+
+// Lock order: the file system lock, the lock of the parent directory, the file lock. The
+// directory entry belongs to the parent directory, so changing its start cluster or length
+// takes the directory lock exclusively before the file lock. Writes that do not grow the
+// file only take the file lock.
+class FatFile : public akaifat::AbstractFsObject, public akaifat::FsFile, public std::enable_shared_from_this<FatFile> {
+public:
+    // Completion callback of the asynchronous operations. error is null on success.
+    using Completion = std::function<void(std::exception_ptr error)>;
+
+    // Exclusive hold on the lock of the parent directory. Empty when the directory is gone.
+    class EntryLock {
+        std::shared_ptr<util::ReentrantSharedMutex> mutex;
+        util::WriteLock lock;
+
+    public:
+        EntryLock() = default;
+
+        explicit EntryLock(std::shared_ptr<util::ReentrantSharedMutex> _mutex) : mutex(std::move(_mutex)) {
+            if (mutex) lock = util::WriteLock(*mutex);
+        }
+
+        explicit operator bool() const {
+            return lock.owns_lock();
+        }
+    };
+
 private:
     std::shared_ptr<FatDirectoryEntry> entry;
     ClusterChain chain;
-    std::streambuf* ibuf = nullptr;
-    std::streambuf* obuf = nullptr;
+    // Does not keep the directory alive
+    std::weak_ptr<util::ReentrantSharedMutex> directoryLock;
+
+    // Read-ahead. The window doubles with every sequential read that misses the buffer,
+    // up to maxReadAhead, and collapses on a non-sequential read.
+    std::int64_t maxReadAhead = 128 * 1024;
+    std::int64_t readAheadWindow = 0;
+    std::int64_t lastReadEnd = -1;
+    std::vector<char> readAheadData;
+    // File offset of readAheadData[0]
+    std::int64_t readAheadOffset = 0;
+    // Concurrent readers only share the file lock
+    std::mutex readAheadMutex;
+    // Buffers of the open input and output streams
+    std::atomic<std::int64_t> streamBufferBytes{0};
+
+    util::ReentrantSharedMutex lock;
+
+    util::ReentrantSharedMutex &getFsLock() {
+        return chain.getFat()->getLock();
+    }
+
+    void readAhead(std::int64_t offset, char *dest, std::int64_t length) {
+        const bool sequential = offset == lastReadEnd;
+        lastReadEnd = offset + length;
+
+        const auto bufferEnd = readAheadOffset + static_cast<std::int64_t>(readAheadData.size());
+
+        if (offset >= readAheadOffset && offset + length <= bufferEnd) {
+            std::copy_n(readAheadData.data() + (offset - readAheadOffset), length, dest);
+            return;
+        }
+
+        if (!sequential) {
+            readAheadWindow = 0;
+            chain.readData(offset, dest, length);
+            return;
+        }
+
+        if (readAheadWindow == 0)
+            readAheadWindow = std::min<std::int64_t>(2 * chain.getClusterSize(), maxReadAhead);
+        else
+            readAheadWindow = std::min(readAheadWindow * 2, maxReadAhead);
+
+        const auto count = std::min(std::max(length, readAheadWindow), getLength() - offset);
+
+        readAheadData.resize(count);
+        chain.readData(offset, readAheadData.data(), count);
+        readAheadOffset = offset;
+
+        std::copy_n(readAheadData.data(), length, dest);
+
+        // Let the device start on the window after this one
+        const auto next = offset + count;
+        const auto hint = std::min(readAheadWindow, getLength() - next);
+
+        if (hint > 0) chain.willNeed(next, hint);
+    }
+
+    template <typename F>
+    static void complete(const Completion &completion, F &&operation) {
+        std::exception_ptr error;
+
+        try {
+            operation();
+        } catch (...) {
+            error = std::current_exception();
+        }
+
+        if (completion) completion(error);
+    }
+
+    // Callers hold the write lock or readAheadMutex
+    void discardReadAhead() {
+        readAheadData.clear();
+        lastReadEnd = -1;
+    }
+
+    // Reads one cluster at a time. Reads of at least a cluster bypass the buffer.
+    class InputStreamBuf : public std::streambuf {
+    private:
+        std::shared_ptr<FatFile> file;
+        std::vector<char> buffer;
+        // File offset of buffer[0]
+        std::int64_t bufferOffset = 0;
+
+        std::int64_t position() {
+            return bufferOffset + (gptr() - eback());
+        }
+
+        void discard(std::int64_t offset) {
+            bufferOffset = offset;
+            setg(buffer.data(), buffer.data(), buffer.data());
+        }
+
+        // Loads the cluster that contains offset and positions the get area on it
+        int_type fill(std::int64_t offset) {
+            const auto length = file->getLength();
+
+            if (offset >= length) {
+                discard(offset);
+                return traits_type::eof();
+            }
+
+            const auto clusterSize = static_cast<std::int64_t>(buffer.size());
+            const auto start = offset - (offset % clusterSize);
+            const auto count = std::min<std::int64_t>(clusterSize, length - start);
+
+            file->read(start, buffer.data(), count);
+            bufferOffset = start;
+            setg(buffer.data(), buffer.data() + (offset - start), buffer.data() + count);
+
+            return traits_type::to_int_type(*gptr());
+        }
+
+    public:
+        explicit InputStreamBuf(std::shared_ptr<FatFile> _file)
+        : file(std::move(_file)), buffer(file->chain.getClusterSize()) {
+            file->streamBufferBytes += static_cast<std::int64_t>(buffer.size());
+            discard(0);
+        }
+
+        ~InputStreamBuf() override {
+            file->streamBufferBytes -= static_cast<std::int64_t>(buffer.size());
+        }
+
+    protected:
+        int_type underflow() override {
+            if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+            return fill(position());
+        }
+
+        std::streamsize showmanyc() override {
+            const auto remaining = file->getLength() - position();
+            return remaining > 0 ? remaining : -1;
+        }
+
+        // Returns less than n only at the end of the file
+        std::streamsize xsgetn(char* s, std::streamsize n) override {
+            std::streamsize done = 0;
+
+            while (done < n) {
+                if (gptr() == egptr()) {
+                    const auto pos = position();
+                    const auto toRead = std::min<std::int64_t>(n - done, file->getLength() - pos);
+
+                    if (toRead <= 0) break;
+
+                    if (toRead >= static_cast<std::int64_t>(buffer.size())) {
+                        file->read(pos, s + done, toRead);
+                        discard(pos + toRead);
+                        done += toRead;
+                        break;
+                    }
+
+                    // Only fills up to the end of the cluster that contains pos
+                    if (traits_type::eq_int_type(fill(pos), traits_type::eof())) break;
+                }
+
+                const auto count = std::min<std::streamsize>(egptr() - gptr(), n - done);
+                std::copy(gptr(), gptr() + count, s + done);
+                gbump(static_cast<int>(count));
+                done += count;
+            }
+
+            return done;
+        }
+
+        pos_type seekoff(off_type off, std::ios_base::seekdir way, std::ios_base::openmode which) override {
+            if (way == std::ios_base::beg)
+                return seekpos(off, which);
+            else if (way == std::ios_base::cur)
+                return seekpos(position() + off, which);
+            else
+                return seekpos(file->getLength() + off, which);
+        }
+
+        pos_type seekpos(pos_type target, std::ios_base::openmode which) override {
+            const std::int64_t offset = target;
+
+            if (!(which & std::ios_base::in) || offset < 0 || offset > file->getLength())
+                return pos_type(off_type(-1));
+
+            if (offset >= bufferOffset && offset <= bufferOffset + (egptr() - eback()))
+                setg(eback(), eback() + (offset - bufferOffset), egptr());
+            else
+                discard(offset);
+
+            return target;
+        }
+    };
+
+    class InputStream : public std::istream {
+    private:
+        InputStreamBuf buf;
+
+    public:
+        explicit InputStream(std::shared_ptr<FatFile> file) : std::istream(nullptr), buf(std::move(file)) {
+            rdbuf(&buf);
+        }
+    };
+
+    // Collects writes in a buffer that ends on a cluster boundary, so each write to the file
+    // covers at most one cluster. Writes of at least a cluster bypass the buffer.
+    class OutputStreamBuf : public std::streambuf {
+    private:
+        std::shared_ptr<FatFile> file;
+        std::vector<char> buffer;
+        // File offset of buffer[0]
+        std::int64_t bufferOffset = 0;
+
+        void resetPut() {
+            const auto clusterSize = static_cast<std::int64_t>(buffer.size());
+            setp(buffer.data(), buffer.data() + (clusterSize - (bufferOffset % clusterSize)));
+        }
+
+        void writeBuffer() {
+            const auto count = pptr() - pbase();
+
+            if (count > 0) {
+                file->write(bufferOffset, pbase(), count);
+                bufferOffset += count;
+            }
+
+            resetPut();
+        }
+
+    public:
+        explicit OutputStreamBuf(std::shared_ptr<FatFile> _file)
+        : file(std::move(_file)), buffer(file->chain.getClusterSize()) {
+            file->streamBufferBytes += static_cast<std::int64_t>(buffer.size());
+            resetPut();
+        }
+
+        ~OutputStreamBuf() override {
+            try {
+                writeBuffer();
+            } catch (const std::exception&) {
+                // A destructor must not throw. Call flush() on the stream to see errors.
+            }
+
+            file->streamBufferBytes -= static_cast<std::int64_t>(buffer.size());
+        }
+
+    protected:
+        int_type overflow(int_type ch) override {
+            writeBuffer();
+
+            if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+                *pptr() = traits_type::to_char_type(ch);
+                pbump(1);
+            }
+
+            return traits_type::not_eof(ch);
+        }
+
+        int sync() override {
+            writeBuffer();
+            return 0;
+        }
+
+        std::streamsize xsputn(const char* s, std::streamsize n) override {
+            if (n < static_cast<std::streamsize>(buffer.size()))
+                return std::streambuf::xsputn(s, n);
+
+            writeBuffer();
+            file->write(bufferOffset, s, n);
+            bufferOffset += n;
+            resetPut();
+
+            return n;
+        }
+
+        pos_type seekoff(off_type off, std::ios_base::seekdir way, std::ios_base::openmode which) override {
+            const auto position = bufferOffset + (pptr() - pbase());
+
+            if (way == std::ios_base::cur && off == 0)
+                return position;
+
+            if (way == std::ios_base::beg)
+                return seekpos(off, which);
+            else if (way == std::ios_base::cur)
+                return seekpos(position + off, which);
+            else
+                return seekpos(file->getLength() + off, which);
+        }
+
+        pos_type seekpos(pos_type target, std::ios_base::openmode which) override {
+            const std::int64_t offset = target;
+
+            if (!(which & std::ios_base::out) || offset < 0)
+                return pos_type(off_type(-1));
+
+            writeBuffer();
+            bufferOffset = offset;
+            resetPut();
+
+            return target;
+        }
+    };
+
+    class OutputStream : public std::ostream {
+    private:
+        OutputStreamBuf buf;
+
+    public:
+        explicit OutputStream(std::shared_ptr<FatFile> file) : std::ostream(nullptr), buf(std::move(file)) {
+            rdbuf(&buf);
+        }
+    };
 
 public:
-    ~FatFile() { if (obuf != nullptr) delete obuf; if (ibuf != nullptr) delete ibuf; }
     FatFile(const std::shared_ptr<FatDirectoryEntry>& myEntry, ClusterChain _chain)
     : akaifat::AbstractFsObject(myEntry->isReadOnly()), entry(myEntry), chain(std::move(_chain)) {}
     
@@ -43,132 +421,211 @@ public:
     
     std::int64_t getLength() override {
         checkValid();
+        util::ReadLock fsLock(getFsLock());
+        util::ReadLock fileLock(lock);
         
         return entry->getLength();
     }
     
+    // The parent directory calls this before it hands out the file
+    void setDirectoryLock(std::weak_ptr<util::ReentrantSharedMutex> mutex) {
+        directoryLock = std::move(mutex);
+    }
+
+    // Writers that hold the file lock while they change the entry take this first
+    EntryLock lockEntry() {
+        return EntryLock(directoryLock.lock());
+    }
+
     void setLength(std::int64_t length) override {
         checkWritable();
+        util::ReadLock fsLock(getFsLock());
+        auto entryLock = lockEntry();
+        util::WriteLock fileLock(lock);
         
         if (getLength() == length) return;
         
+        discardReadAhead();
         chain.setSize(length);
         
         entry->setStartCluster(chain.getStartCluster());
         entry->setLength(length);
     }
     
+    // Stores the chain's start cluster and the given length in the directory entry,
+    // for writers that grow the chain themselves
+    void updateEntry(std::int64_t length) {
+        checkWritable();
+        util::ReadLock fsLock(getFsLock());
+        auto entryLock = lockEntry();
+        util::WriteLock fileLock(lock);
+
+        discardReadAhead();
+        entry->setStartCluster(chain.getStartCluster());
+        entry->setLength(length);
+    }
+    
     void read(std::int64_t offset, ByteBuffer &dest) override {
+        const auto len = dest.remaining();
+        read(offset, dest.getBuffer().data() + dest.position(), len);
+        dest.position(dest.position() + len);
+    }
+    
+    void write(std::int64_t offset, ByteBuffer &srcBuf) override {
+        const auto len = srcBuf.remaining();
+        write(offset, srcBuf.getBuffer().data() + srcBuf.position(), len);
+        srcBuf.position(srcBuf.position() + len);
+    }
+    
+    void read(std::int64_t offset, char *dest, std::int64_t length) override {
         checkValid();
         
-        auto len = dest.remaining();
+        if (length == 0) return;
         
-        if (len == 0) return;
-        
-        if (offset + len > getLength())
+        util::ReadLock fsLock(getFsLock());
+        util::ReadLock fileLock(lock);
+
+        if (offset + length > getLength())
             throw std::runtime_error("EOF");
         
-        chain.readData(offset, dest);
+        std::unique_lock<std::mutex> readAheadLock(readAheadMutex);
+
+        if (length >= maxReadAhead) {
+            lastReadEnd = offset + length;
+            readAheadLock.unlock();
+            chain.readData(offset, dest, length);
+            return;
+        }
+
+        readAhead(offset, dest, length);
     }
     
-    void write(std::int64_t offset, ByteBuffer &srcBuf) override {
+    void write(std::int64_t offset, const char *src, std::int64_t length) override {
         
         checkWritable();
-        
-        std::int64_t lastByte = offset + srcBuf.remaining();
-        
-        if (lastByte > getLength())
+        util::ReadLock fsLock(getFsLock());
+
+        std::int64_t lastByte = offset + length;
+
+        // Growing changes the entry, so the directory lock has to be taken first
+        auto entryLock = lastByte > getLength() ? lockEntry() : EntryLock();
+        util::WriteLock fileLock(lock);
+
+        if (lastByte > getLength()) {
+            if (!entryLock && !directoryLock.expired()) {
+                // Truncated since the check above
+                fileLock.unlock();
+                write(offset, src, length);
+                return;
+            }
+
             setLength(lastByte);
+        }
         
-        chain.writeData(offset, srcBuf);
+        discardReadAhead();
+        chain.writeData(offset, src, length);
+        chain.getFat()->addDirtyBytes(length);
     }
     
     void flush() override {
         checkWritable();
     }
+
+    // The asynchronous operations run on the file system's I/O queue, in submission order.
+    // The caller keeps dest/src valid until the operation has completed.
+    std::future<void> readAsync(std::int64_t offset, char *dest, std::int64_t length) {
+        auto self = shared_from_this();
+        return chain.getFat()->getIoQueue()->submit([self, offset, dest, length] {
+            self->read(offset, dest, length);
+        });
+    }
+
+    std::future<void> writeAsync(std::int64_t offset, const char *src, std::int64_t length) {
+        auto self = shared_from_this();
+        return chain.getFat()->getIoQueue()->submit([self, offset, src, length] {
+            self->write(offset, src, length);
+        });
+    }
+
+    // The callback runs on an I/O thread, and may start further operations from there
+    void readAsync(std::int64_t offset, char *dest, std::int64_t length, Completion completion) {
+        auto self = shared_from_this();
+        chain.getFat()->getIoQueue()->submit([self, offset, dest, length, completion = std::move(completion)] {
+            complete(completion, [&] { self->read(offset, dest, length); });
+        });
+    }
+
+    void writeAsync(std::int64_t offset, const char *src, std::int64_t length, Completion completion) {
+        auto self = shared_from_this();
+        chain.getFat()->getIoQueue()->submit([self, offset, src, length, completion = std::move(completion)] {
+            complete(completion, [&] { self->write(offset, src, length); });
+        });
+    }
+
+    // Maps [offset, offset + length) without copying. Returns nullptr when the device is not
+    // memory mapped.
+    std::shared_ptr<FatFileView> getView(std::int64_t offset, std::int64_t length) {
+        checkValid();
+        util::ReadLock fsLock(getFsLock());
+        util::ReadLock fileLock(lock);
+
+        if (offset < 0 || offset + length > getLength())
+            throw std::runtime_error("EOF");
+
+        auto mapping = chain.getDevice()->getMapping();
+
+        if (!mapping) return nullptr;
+
+        std::vector<FatFileView::Span> spans;
+
+        for (auto& extent : chain.getExtents(offset, length))
+            spans.push_back({mapping.get() + extent.devOffset, static_cast<std::size_t>(extent.length)});
+
+        return std::make_shared<FatFileView>(std::move(mapping), std::move(spans));
+    }
+
+    std::shared_ptr<FatFileView> getView() {
+        return getView(0, getLength());
+    }
+
+    // Upper bound of the read-ahead window in bytes. 0 turns read-ahead off.
+    void setMaxReadAhead(std::int64_t bytes) {
+        std::lock_guard<std::mutex> guard(readAheadMutex);
+        maxReadAhead = std::max<std::int64_t>(bytes, 0);
+        readAheadWindow = 0;
+        discardReadAhead();
+        readAheadData.shrink_to_fit();
+    }
     
+    // Estimated heap use of this file, its read-ahead buffer and the buffers of its open streams
+    std::int64_t getMemoryUsage() {
+        std::lock_guard<std::mutex> guard(readAheadMutex);
+        return static_cast<std::int64_t>(sizeof(FatFile) + readAheadData.capacity()) + streamBufferBytes.load();
+    }
+
+    // Guards the length and cluster chain of this file. Reads take it shared, changes take it
+    // exclusively, in both cases after taking the file system lock shared, and after
+    // lockEntry() when the change reaches the directory entry.
+    util::ReentrantSharedMutex &getLock() {
+        return lock;
+    }
+
     ClusterChain& getChain() {
         checkValid();
         
         return chain;
     }
     
+    // The returned stream keeps this file alive and owns its buffer
     std::shared_ptr<std::istream> getInputStream() {
-        
-        class akai_streambuf : public std::streambuf
-        {
-        private:
-            FatFile* fatFile;
-            std::streampos pos = 0;
-        public:
-            akai_streambuf(FatFile* _fatFile) : fatFile (_fatFile) {}
-        protected:
-            std::streampos seekoff(std::streamoff off, std::ios_base::seekdir way, std::ios_base::openmode = std::ios_base::in) override
-            {
-                if (way == std::ios_base::beg)
-                    pos = off;
-                else if (way == std::ios_base::cur)
-                    pos += off;
-                else if (way == std::ios_base::end)
-                    pos = fatFile->getLength() + off;
-                return pos;
-            }
-            std::streamsize xsgetn (char* s, std::streamsize n) override
-            {
-                ByteBuffer bb(n);
-                fatFile->read(pos, bb);
-                auto& buf = bb.getBuffer();
-                for (size_t i=0;i<n;i++) s[i]=buf[i];
-                pos += n;
-                return n;
-            }
-        };
-        
-        if (ibuf != nullptr)
-            delete ibuf;
-        
-        ibuf = new akai_streambuf(this);
-        
-        return std::make_shared<std::istream>(ibuf);
+        checkValid();
+        return std::make_shared<InputStream>(shared_from_this());
     }
     
+    // Writes from the start of the file. Data reaches the file on flush() or when the stream is destroyed.
     std::unique_ptr<std::ostream> getOutputStream() {
-        class akai_streambuf : public std::streambuf
-        {
-        private:
-            std::streampos pos = 0;
-            FatFile* fatFile;
-            ByteBuffer bb = ByteBuffer(0);
-        public:
-            akai_streambuf(FatFile* _fatFile) : fatFile (_fatFile) {}
-        protected:
-            std::streampos seekoff(std::streamoff off, std::ios_base::seekdir way, std::ios_base::openmode = std::ios_base::out) override
-            {
-                if (way == std::ios_base::beg)
-                    pos = off;
-                else if (way == std::ios_base::cur)
-                    pos += off;
-                else if (way == std::ios_base::end)
-                    pos = fatFile->getLength() + off;
-                return pos;
-            }
-            std::streamsize xsputn (const char* s, std::streamsize n) override
-            {
-                bb.clearAndAllocate(n);
-                auto& buf = bb.getBuffer();
-                for (size_t i=0;i<n;i++) buf[i]=s[i];
-                fatFile->write(pos, bb);
-                pos += n;
-                return n;
-            }
-        };
-        
-        if (obuf != nullptr)
-            delete obuf;
-        
-        obuf = new akai_streambuf(this);
-        
-        return std::make_unique<std::ostream>(ibuf);
+        checkWritable();
+        return std::make_unique<OutputStream>(shared_from_this());
     }
 };
 }
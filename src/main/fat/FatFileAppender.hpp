@@ -0,0 +1,115 @@
+#pragma once
+
+#include "FatFile.hpp"
+#include "ClusterChain.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace akaifat::fat {
+
+/*
+ * Appends to the end of a FatFile. The chain is looked up once; after that the appender
+ * remembers its clusters, so growing the file does not walk the chain again. Clusters are
+ * allocated in batches, and close() gives back the ones that were not used.
+ *
+ * Do not change the file through other means while an appender is open.
+ */
+class FatFileAppender {
+private:
+    std::shared_ptr<FatFile> file;
+    ClusterChain &chain;
+    std::vector<std::int64_t> clusters;
+    std::int64_t length;
+    std::int32_t batchClusters = 16;
+    bool closed = false;
+
+    std::int64_t getCapacity() {
+        return static_cast<std::int64_t>(clusters.size()) * chain.getClusterSize();
+    }
+
+    void reserve(std::int64_t minLength) {
+        if (minLength <= getCapacity()) return;
+
+        const std::int64_t clusterSize = chain.getClusterSize();
+        const auto needed = static_cast<std::int32_t>((minLength - getCapacity() + clusterSize - 1) / clusterSize);
+        const auto tail = clusters.empty() ? 0 : clusters.back();
+
+        auto added = chain.appendClusters(tail, std::max(needed, batchClusters));
+        clusters.insert(end(clusters), begin(added), end(added));
+    }
+
+public:
+    explicit FatFileAppender(std::shared_ptr<FatFile> _file)
+    : file(std::move(_file)), chain(file->getChain()), length(file->getLength()) {
+        util::ReadLock fsLock(chain.getFat()->getLock());
+        util::ReadLock fileLock(file->getLock());
+
+        if (chain.getStartCluster() != 0)
+            clusters = chain.getFat()->getChain(chain.getStartCluster());
+    }
+
+    FatFileAppender(const FatFileAppender &) = delete;
+    FatFileAppender &operator=(const FatFileAppender &) = delete;
+
+    ~FatFileAppender() {
+        try {
+            close();
+        } catch (const std::exception&) {
+            // A destructor must not throw. Call close() to see errors.
+        }
+    }
+
+    // Number of clusters allocated at once when the file has to grow
+    void setBatchClusters(std::int32_t count) {
+        batchClusters = std::max(count, 1);
+    }
+
+    std::int64_t getLength() {
+        return length;
+    }
+
+    void append(const char *src, std::int64_t len) {
+        if (closed) throw std::runtime_error("appender is closed");
+
+        if (len == 0) return;
+
+        util::ReadLock fsLock(chain.getFat()->getLock());
+        auto entryLock = file->lockEntry();
+        util::WriteLock fileLock(file->getLock());
+        reserve(length + len);
+        chain.writeData(clusters, length, src, len);
+        chain.getFat()->addDirtyBytes(len);
+        length += len;
+
+        file->updateEntry(length);
+    }
+
+    void append(ByteBuffer &src) {
+        const auto len = src.remaining();
+        append(src.getBuffer().data() + src.position(), len);
+        src.position(src.position() + len);
+    }
+
+    // Frees the clusters beyond the end of the file
+    void close() {
+        if (closed) return;
+
+        closed = true;
+
+        util::ReadLock fsLock(chain.getFat()->getLock());
+        auto entryLock = file->lockEntry();
+        util::WriteLock fileLock(file->getLock());
+
+        const std::int64_t clusterSize = chain.getClusterSize();
+        const auto used = static_cast<std::int32_t>((length + clusterSize - 1) / clusterSize);
+
+        if (used != static_cast<std::int32_t>(clusters.size()))
+            chain.setChainLength(used);
+
+        file->updateEntry(length);
+    }
+};
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+// Coroutine adapters for the asynchronous FatFile operations. Only available when the
+// library is built with AKAIFAT_COROUTINES (C++20).
+#ifdef AKAIFAT_COROUTINES
+
+#include "FatFile.hpp"
+
+#include <coroutine>
+#include <exception>
+#include <memory>
+
+namespace akaifat::fat {
+
+// co_await readAwaitable(file, ...) suspends until the read has completed and rethrows its
+// error, if any. The coroutine resumes on the I/O thread that ran the read, and can issue its
+// next operation from there without waiting for room in the I/O queue.
+class FatFileAwaitable {
+private:
+    std::shared_ptr<FatFile> file;
+    std::int64_t offset;
+    char *dest;
+    const char *src;
+    std::int64_t length;
+    std::exception_ptr error;
+
+public:
+    FatFileAwaitable(std::shared_ptr<FatFile> _file, std::int64_t _offset, char *_dest, const char *_src, std::int64_t _length)
+    : file(std::move(_file)), offset(_offset), dest(_dest), src(_src), length(_length) {}
+
+    bool await_ready() const noexcept { return length == 0; }
+
+    void await_suspend(std::coroutine_handle<> handle) {
+        auto completion = [this, handle](std::exception_ptr e) {
+            error = e;
+            handle.resume();
+        };
+
+        if (dest != nullptr)
+            file->readAsync(offset, dest, length, completion);
+        else
+            file->writeAsync(offset, src, length, completion);
+    }
+
+    void await_resume() {
+        if (error) std::rethrow_exception(error);
+    }
+};
+
+inline FatFileAwaitable readAwaitable(std::shared_ptr<FatFile> file, std::int64_t offset, char *dest, std::int64_t length) {
+    return {std::move(file), offset, dest, nullptr, length};
+}
+
+inline FatFileAwaitable writeAwaitable(std::shared_ptr<FatFile> file, std::int64_t offset, const char *src, std::int64_t length) {
+    return {std::move(file), offset, nullptr, src, length};
+}
+}
+
+#endif
@@ -0,0 +1,313 @@
+#pragma once
+
+#include "../BlockDevice.hpp"
+#include "../util/Trace.hpp"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <utility>
+
+namespace akaifat::fat {
+
+class StatsCounter {
+private:
+    std::atomic<std::uint64_t> value{0};
+
+public:
+    void add(std::uint64_t n = 1) {
+        value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    std::uint64_t get() const {
+        return value.load(std::memory_order_relaxed);
+    }
+
+    void reset() {
+        value.store(0, std::memory_order_relaxed);
+    }
+};
+
+// Bucket i counts durations below 2^i microseconds that did not fit in bucket i - 1. The last
+// bucket takes everything longer.
+class LatencyHistogram {
+public:
+    static constexpr std::size_t BUCKET_COUNT = 24;
+
+private:
+    std::array<std::atomic<std::uint64_t>, BUCKET_COUNT> buckets{};
+    std::atomic<std::uint64_t> count{0};
+    std::atomic<std::uint64_t> totalNs{0};
+
+public:
+    void record(std::uint64_t ns) {
+        const auto us = ns / 1000;
+        std::size_t bucket = 0;
+
+        while (bucket < BUCKET_COUNT - 1 && (std::uint64_t{1} << bucket) <= us)
+            bucket++;
+
+        buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+        totalNs.fetch_add(ns, std::memory_order_relaxed);
+    }
+
+    std::uint64_t getCount() const {
+        return count.load(std::memory_order_relaxed);
+    }
+
+    std::uint64_t getTotalNs() const {
+        return totalNs.load(std::memory_order_relaxed);
+    }
+
+    std::uint64_t getBucket(std::size_t i) const {
+        return buckets[i].load(std::memory_order_relaxed);
+    }
+
+    void reset() {
+        for (auto &bucket : buckets)
+            bucket.store(0, std::memory_order_relaxed);
+
+        count.store(0, std::memory_order_relaxed);
+        totalNs.store(0, std::memory_order_relaxed);
+    }
+};
+
+/*
+ * Counters and latency histograms of one mount, see AkaiFatFileSystem::stats(). Everything
+ * is a relaxed atomic, so recording never blocks. Recording is off by default; while it is
+ * off, the instrumented code only pays for one relaxed load.
+ */
+class FileSystemStats {
+private:
+    std::atomic<bool> enabled{false};
+
+    // Calls onCounter and onHistogram with the name and the member of every counter and
+    // histogram of self, which may be const
+    template<typename Self, typename Counters, typename Histograms>
+    static void forEach(Self &self, Counters onCounter, Histograms onHistogram) {
+        static const std::pair<const char *, StatsCounter FileSystemStats::*> counters[] = {
+                {"deviceReads", &FileSystemStats::deviceReads},
+                {"deviceReadBytes", &FileSystemStats::deviceReadBytes},
+                {"deviceWrites", &FileSystemStats::deviceWrites},
+                {"deviceWriteBytes", &FileSystemStats::deviceWriteBytes},
+                {"fatLookups", &FileSystemStats::fatLookups},
+                {"chainWalks", &FileSystemStats::chainWalks},
+                {"allocations", &FileSystemStats::allocations},
+                {"directoryParses", &FileSystemStats::directoryParses},
+                {"directoryFlushes", &FileSystemStats::directoryFlushes},
+                {"objectCacheHits", &FileSystemStats::objectCacheHits},
+                {"objectCacheMisses", &FileSystemStats::objectCacheMisses},
+                {"dentryCacheHits", &FileSystemStats::dentryCacheHits},
+                {"dentryCacheMisses", &FileSystemStats::dentryCacheMisses}
+        };
+
+        static const std::pair<const char *, LatencyHistogram FileSystemStats::*> histograms[] = {
+                {"deviceRead", &FileSystemStats::deviceReadLatency},
+                {"deviceWrite", &FileSystemStats::deviceWriteLatency},
+                {"chainWalk", &FileSystemStats::chainWalkLatency},
+                {"allocation", &FileSystemStats::allocationLatency},
+                {"directoryParse", &FileSystemStats::directoryParseLatency},
+                {"directoryFlush", &FileSystemStats::directoryFlushLatency},
+                {"flush", &FileSystemStats::flushLatency}
+        };
+
+        for (auto &c : counters) onCounter(c.first, self.*c.second);
+        for (auto &h : histograms) onHistogram(h.first, self.*h.second);
+    }
+
+public:
+    StatsCounter deviceReads;
+    StatsCounter deviceReadBytes;
+    StatsCounter deviceWrites;
+    StatsCounter deviceWriteBytes;
+    // Fat::getNextCluster() and Fat::getEntry()
+    StatsCounter fatLookups;
+    // Fat::getChain()
+    StatsCounter chainWalks;
+    // Clusters handed out by Fat::allocNew()
+    StatsCounter allocations;
+    StatsCounter directoryParses;
+    StatsCounter directoryFlushes;
+    // Files and subdirectories found loaded, or read from the device
+    StatsCounter objectCacheHits;
+    StatsCounter objectCacheMisses;
+    // Paths looked up by AkaiFatFileSystem::resolve()
+    StatsCounter dentryCacheHits;
+    StatsCounter dentryCacheMisses;
+
+    LatencyHistogram deviceReadLatency;
+    LatencyHistogram deviceWriteLatency;
+    LatencyHistogram chainWalkLatency;
+    LatencyHistogram allocationLatency;
+    LatencyHistogram directoryParseLatency;
+    LatencyHistogram directoryFlushLatency;
+    LatencyHistogram flushLatency;
+
+    bool isEnabled() const {
+        return enabled.load(std::memory_order_relaxed);
+    }
+
+    void setEnabled(bool newEnabled) {
+        enabled.store(newEnabled, std::memory_order_relaxed);
+    }
+
+    void count(StatsCounter &counter, std::uint64_t n = 1) {
+        if (isEnabled()) counter.add(n);
+    }
+
+    void reset() {
+        forEach(*this,
+                [](const char *, StatsCounter &c) { c.reset(); },
+                [](const char *, LatencyHistogram &h) { h.reset(); });
+    }
+
+    // {"counters": {"deviceReads": 12, ...},
+    //  "histograms": {"deviceRead": {"count": 12, "totalNs": 34000, "bucketsUs": {"1": 10, "4": 2}}, ...}}
+    // Each bucket is keyed by its upper bound in microseconds, the last one by "inf". Empty
+    // buckets are left out.
+    std::string toJson() const {
+        std::ostringstream counters;
+        std::ostringstream histograms;
+        const char *counterSeparator = "";
+        const char *histogramSeparator = "";
+
+        forEach(*this,
+                [&](const char *name, const StatsCounter &c) {
+                    counters << counterSeparator << "\"" << name << "\": " << c.get();
+                    counterSeparator = ", ";
+                },
+                [&](const char *name, const LatencyHistogram &h) {
+                    histograms << histogramSeparator << "\"" << name << "\": {\"count\": " << h.getCount()
+                               << ", \"totalNs\": " << h.getTotalNs() << ", \"bucketsUs\": {";
+                    histogramSeparator = ", ";
+
+                    const char *bucketSeparator = "";
+
+                    for (std::size_t i = 0; i < LatencyHistogram::BUCKET_COUNT; i++) {
+                        const auto n = h.getBucket(i);
+
+                        if (n == 0) continue;
+
+                        histograms << bucketSeparator << "\"";
+
+                        if (i == LatencyHistogram::BUCKET_COUNT - 1)
+                            histograms << "inf";
+                        else
+                            histograms << (std::uint64_t{1} << i);
+
+                        histograms << "\": " << n;
+                        bucketSeparator = ", ";
+                    }
+
+                    histograms << "}}";
+                });
+
+        return "{\"counters\": {" + counters.str() + "}, \"histograms\": {" + histograms.str() + "}}";
+    }
+};
+
+// Records into histogram for as long as it lives, if recording was on when it was created
+class ScopedLatency {
+private:
+    using Clock = std::chrono::steady_clock;
+
+    LatencyHistogram *histogram;
+    Clock::time_point start;
+
+public:
+    ScopedLatency(const FileSystemStats &stats, LatencyHistogram &_histogram)
+    : histogram(stats.isEnabled() ? &_histogram : nullptr) {
+        if (histogram) start = Clock::now();
+    }
+
+    ScopedLatency(const ScopedLatency &) = delete;
+    ScopedLatency &operator=(const ScopedLatency &) = delete;
+
+    ~ScopedLatency() {
+        if (histogram)
+            histogram->record(static_cast<std::uint64_t>(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count()));
+    }
+};
+
+// Counts and traces the calls that reach the device. AkaiFatFileSystem puts it in front of
+// the device it mounts. Reads served from getMappedData() do not reach the device and are
+// not counted.
+class StatsBlockDevice : public BlockDevice {
+private:
+    std::shared_ptr<BlockDevice> device;
+    std::shared_ptr<FileSystemStats> stats;
+
+public:
+    StatsBlockDevice(std::shared_ptr<BlockDevice> _device, std::shared_ptr<FileSystemStats> _stats)
+    : device(std::move(_device)), stats(std::move(_stats)) {}
+
+    std::int64_t getSize() override { return device->getSize(); }
+
+    void read(std::int64_t devOffset, ByteBuffer &dest) override {
+        util::TraceScope trace("BlockDevice::read", devOffset, dest.remaining());
+        ScopedLatency latency(*stats, stats->deviceReadLatency);
+        stats->count(stats->deviceReads);
+        stats->count(stats->deviceReadBytes, dest.remaining());
+        device->read(devOffset, dest);
+    }
+
+    void write(std::int64_t devOffset, ByteBuffer &src) override {
+        util::TraceScope trace("BlockDevice::write", devOffset, src.remaining());
+        ScopedLatency latency(*stats, stats->deviceWriteLatency);
+        stats->count(stats->deviceWrites);
+        stats->count(stats->deviceWriteBytes, src.remaining());
+        device->write(devOffset, src);
+    }
+
+    void read(std::int64_t devOffset, char *dest, std::int64_t length) override {
+        util::TraceScope trace("BlockDevice::read", devOffset, length);
+        ScopedLatency latency(*stats, stats->deviceReadLatency);
+        stats->count(stats->deviceReads);
+        stats->count(stats->deviceReadBytes, length);
+        device->read(devOffset, dest, length);
+    }
+
+    void write(std::int64_t devOffset, const char *src, std::int64_t length) override {
+        util::TraceScope trace("BlockDevice::write", devOffset, length);
+        ScopedLatency latency(*stats, stats->deviceWriteLatency);
+        stats->count(stats->deviceWrites);
+        stats->count(stats->deviceWriteBytes, length);
+        device->write(devOffset, src, length);
+    }
+
+    void willNeed(std::int64_t devOffset, std::int64_t length) override { device->willNeed(devOffset, length); }
+
+    const char *getMappedData(std::int64_t devOffset) override { return device->getMappedData(devOffset); }
+
+    std::shared_ptr<const char> getMapping() override { return device->getMapping(); }
+
+    int getFileDescriptor() override { return device->getFileDescriptor(); }
+
+    void flush() override {
+        util::TraceScope trace("BlockDevice::flush");
+        device->flush();
+    }
+
+    void sync() override {
+        util::TraceScope trace("BlockDevice::sync");
+        device->sync();
+    }
+
+    bool canSync() override { return device->canSync(); }
+
+    std::int32_t getSectorSize() override { return device->getSectorSize(); }
+
+    void close() override { device->close(); }
+
+    bool isClosed() override { return device->isClosed(); }
+
+    bool isReadOnly() override { return device->isReadOnly(); }
+};
+}
@@ -0,0 +1,179 @@
+#pragma once
+
+#include "FatFile.hpp"
+#include "ClusterChain.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined (__linux__)
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace akaifat::fat {
+
+/*
+ * Copies files between a mounted image and the host file system. On Linux, when the device
+ * exposes the descriptor of its image file, every extent of the FAT file becomes one
+ * copy_file_range call, so the data does not pass through user space. Otherwise, or when
+ * the kernel cannot copy between the two files, the data goes through a buffer.
+ */
+class FileTransfer {
+private:
+    static constexpr std::int64_t BUFFER_SIZE = 1024 * 1024;
+
+#if defined (__linux__)
+    class Descriptor {
+    public:
+        int fd;
+        explicit Descriptor(int _fd) : fd(_fd) {}
+        ~Descriptor() { if (fd >= 0) ::close(fd); }
+    };
+
+    static std::runtime_error error(const std::string& what) {
+        return std::runtime_error(what + ": " + std::strerror(errno));
+    }
+
+    // Returns false if the kernel cannot copy between these files and nothing was copied
+    static bool copyRange(int inFd, std::int64_t inOffset, int outFd, std::int64_t outOffset, std::int64_t length) {
+        loff_t in = inOffset;
+        loff_t out = outOffset;
+        bool copied = false;
+
+        while (length > 0) {
+            auto n = ::copy_file_range(inFd, &in, outFd, &out, static_cast<size_t>(length), 0);
+
+            if (n < 0) {
+                if (!copied && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP))
+                    return false;
+
+                throw error("copy_file_range failed");
+            }
+
+            if (n == 0) throw std::runtime_error("copy_file_range stopped early");
+
+            length -= n;
+            copied = true;
+        }
+
+        return true;
+    }
+
+    static bool kernelExport(const std::shared_ptr<FatFile>& file, int imageFd, const std::string& hostPath) {
+        Descriptor out(::open(hostPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644));
+
+        if (out.fd < 0) throw error("cannot open " + hostPath);
+
+        util::ReadLock fsLock(file->getChain().getFat()->getLock());
+        util::ReadLock fileLock(file->getLock());
+        std::int64_t hostOffset = 0;
+
+        for (auto& extent : file->getChain().getExtents(0, file->getLength())) {
+            if (!copyRange(imageFd, extent.devOffset, out.fd, hostOffset, extent.length)) return false;
+            hostOffset += extent.length;
+        }
+
+        return true;
+    }
+
+    static bool kernelImport(const std::string& hostPath, const std::shared_ptr<FatFile>& file, int imageFd) {
+        Descriptor in(::open(hostPath.c_str(), O_RDONLY));
+
+        if (in.fd < 0) throw error("cannot open " + hostPath);
+
+        struct stat st{};
+
+        if (::fstat(in.fd, &st) != 0) throw error("cannot stat " + hostPath);
+
+        const std::int64_t length = st.st_size;
+
+        util::ReadLock fsLock(file->getChain().getFat()->getLock());
+        auto entryLock = file->lockEntry();
+        util::WriteLock fileLock(file->getLock());
+        file->setLength(length);
+
+        std::int64_t hostOffset = 0;
+
+        for (auto& extent : file->getChain().getExtents(0, length)) {
+            if (!copyRange(in.fd, hostOffset, imageFd, extent.devOffset, extent.length)) return false;
+            hostOffset += extent.length;
+        }
+
+        // The data bypassed FatFile, make it drop whatever it buffered
+        file->updateEntry(length);
+        file->getChain().getFat()->addDirtyBytes(length);
+        return true;
+    }
+#endif
+
+    static void bufferedExport(const std::shared_ptr<FatFile>& file, const std::string& hostPath) {
+        std::ofstream out(hostPath, std::ios_base::binary | std::ios_base::trunc);
+
+        if (!out) throw std::runtime_error("cannot open " + hostPath);
+
+        const auto length = file->getLength();
+        std::vector<char> buffer(std::min(length, BUFFER_SIZE));
+
+        for (std::int64_t offset = 0; offset < length; offset += buffer.size()) {
+            const auto count = std::min<std::int64_t>(buffer.size(), length - offset);
+            file->read(offset, buffer.data(), count);
+            out.write(buffer.data(), count);
+        }
+
+        if (!out.flush()) throw std::runtime_error("cannot write " + hostPath);
+    }
+
+    static void bufferedImport(const std::string& hostPath, const std::shared_ptr<FatFile>& file) {
+        std::ifstream in(hostPath, std::ios_base::binary);
+
+        if (!in) throw std::runtime_error("cannot open " + hostPath);
+
+        in.seekg(0, std::ios_base::end);
+        const std::int64_t length = in.tellg();
+        in.seekg(0);
+
+        file->setLength(length);
+
+        std::vector<char> buffer(std::min(length, BUFFER_SIZE));
+
+        for (std::int64_t offset = 0; offset < length; offset += buffer.size()) {
+            const auto count = std::min<std::int64_t>(buffer.size(), length - offset);
+
+            if (!in.read(buffer.data(), count)) throw std::runtime_error("cannot read " + hostPath);
+
+            file->write(offset, buffer.data(), count);
+        }
+    }
+
+public:
+    // Writes the contents of file to hostPath, replacing what was there
+    static void exportFile(const std::shared_ptr<FatFile>& file, const std::string& hostPath) {
+#if defined (__linux__)
+        const auto imageFd = file->getChain().getDevice()->getFileDescriptor();
+
+        if (imageFd >= 0 && kernelExport(file, imageFd, hostPath)) return;
+#endif
+        bufferedExport(file, hostPath);
+    }
+
+    // Replaces the contents of file with those of hostPath
+    static void importFile(const std::string& hostPath, const std::shared_ptr<FatFile>& file) {
+#if defined (__linux__)
+        auto device = file->getChain().getDevice();
+        const auto imageFd = device->getFileDescriptor();
+
+        if (imageFd >= 0 && !device->isReadOnly() && kernelImport(hostPath, file, imageFd)) return;
+#endif
+        bufferedImport(hostPath, file);
+    }
+};
+}
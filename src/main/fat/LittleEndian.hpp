@@ -1,5 +1,6 @@
 #pragma once
 
+#include <array>
 #include <vector>
 #include <climits>
 #include <stdexcept>
@@ -11,17 +12,22 @@ namespace akaifat::fat {
         LittleEndian() = default;
 
     public:
-        static std::int32_t getUInt8(std::vector<char> &src, std::int32_t offset) {
+        // Bytes is any contiguous char container: std::vector<char> or std::array<char, N>
+
+        template <typename Bytes>
+        static std::int32_t getUInt8(const Bytes &src, std::int32_t offset) {
             return src[offset] & 0xFF;
         }
 
-        static std::int32_t getUInt16(std::vector<char> &src, std::int32_t offset) {
+        template <typename Bytes>
+        static std::int32_t getUInt16(const Bytes &src, std::int32_t offset) {
             std::int32_t v0 = src[offset + 0] & 0xFF;
             std::int32_t v1 = src[offset + 1] & 0xFF;
             return ((v1 << 8) | v0);
         }
 
-        static std::int64_t getUInt32(std::vector<char> &src, std::int32_t offset) {
+        template <typename Bytes>
+        static std::int64_t getUInt32(const Bytes &src, std::int32_t offset) {
             std::int64_t v0 = src[offset + 0] & 0xFF;
             std::int64_t v1 = src[offset + 1] & 0xFF;
             std::int64_t v2 = src[offset + 2] & 0xFF;
@@ -29,20 +35,23 @@ namespace akaifat::fat {
             return ((v3 << 24) | (v2 << 16) | (v1 << 8) | v0);
         }
 
-        static void setInt8(std::vector<char> &dst, std::int32_t offset, std::int32_t value) {
+        template <typename Bytes>
+        static void setInt8(Bytes &dst, std::int32_t offset, std::int32_t value) {
             if ((value & 0xff) != value) throw std::runtime_error("value out of range");
 
             dst[offset] = (char) value;
         }
 
-        static void setInt16(std::vector<char> &dst, std::int32_t offset, std::int32_t value) {
+        template <typename Bytes>
+        static void setInt16(Bytes &dst, std::int32_t offset, std::int32_t value) {
             if ((value & 0xffff) != value) throw std::runtime_error("value out of range");
 
             dst[offset + 0] = (char) (value & 0xFF);
             dst[offset + 1] = (char) ((value >> 8) & 0xFF);
         }
 
-        static void setInt32(std::vector<char> &dst, std::int32_t offset, std::int64_t value) {
+        template <typename Bytes>
+        static void setInt32(Bytes &dst, std::int32_t offset, std::int64_t value) {
 
             if (value > INT_MAX) throw std::runtime_error("value out of range");
 
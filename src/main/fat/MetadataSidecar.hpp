@@ -0,0 +1,313 @@
+#pragma once
+
+#if defined (__linux__) || defined (__APPLE__)
+
+#include "AkaiFatFileSystem.hpp"
+#include "AkaiFatDirectoryWalker.hpp"
+#include "ClusterChain.hpp"
+
+#include "../MappedImageBlockDevice.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+namespace akaifat::fat {
+
+/*
+ * Sidecar file holding the metadata regions of a read-only image: the boot sector, the
+ * FATs, the root directory and the clusters of every subdirectory. open() maps it and returns
+ * a device on which mounting, parsing directories and resolving paths read from the mapping
+ * instead of the image. Name indexes are rebuilt from the cached directory bytes, which
+ * takes no I/O.
+ *
+ * A sidecar is only used while the image has the size and modification time it was written
+ * for and its boot sector hashes the same. Optionally the FAT is hashed as well.
+ * Sidecars use the byte order of the host that wrote them.
+ */
+class MetadataSidecar {
+private:
+    static constexpr char MAGIC[8] = {'A', 'K', 'F', 'A', 'T', 'M', 'D', '\0'};
+    static constexpr std::uint32_t VERSION = 1;
+
+    struct Header {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t rangeCount;
+        std::int64_t imageSize;
+        std::int64_t imageTime;
+        std::uint64_t bootSectorHash;
+        // Boot sector followed by FAT 0
+        std::uint64_t metadataHash;
+    };
+
+    struct Range {
+        std::int64_t devOffset;
+        std::int64_t length;
+        std::int64_t fileOffset;
+    };
+
+    // Serves reads that fall inside a cached range from the sidecar, everything else from
+    // the image
+    class Device : public BlockDevice {
+    private:
+        std::shared_ptr<BlockDevice> image;
+        std::shared_ptr<BlockDevice> sidecar;
+        std::vector<Range> ranges;
+
+    public:
+        Device(std::shared_ptr<BlockDevice> _image, std::shared_ptr<BlockDevice> _sidecar, std::vector<Range> _ranges)
+        : image(std::move(_image)), sidecar(std::move(_sidecar)), ranges(std::move(_ranges)) {}
+
+        std::int64_t getSize() override { return image->getSize(); }
+
+        void read(std::int64_t devOffset, ByteBuffer& dest) override {
+            const auto length = dest.remaining();
+            read(devOffset, dest.getBuffer().data() + dest.position(), length);
+            dest.position(dest.position() + length);
+        }
+
+        void write(std::int64_t, ByteBuffer&) override {
+            throw std::runtime_error("device is read only");
+        }
+
+        void read(std::int64_t devOffset, char* dest, std::int64_t length) override {
+            auto it = std::upper_bound(begin(ranges), end(ranges), devOffset,
+                                       [](std::int64_t offset, const Range& r) { return offset < r.devOffset; });
+
+            if (it != begin(ranges)) {
+                auto& range = *(it - 1);
+
+                if (devOffset + length <= range.devOffset + range.length) {
+                    sidecar->read(range.fileOffset + (devOffset - range.devOffset), dest, length);
+                    return;
+                }
+            }
+
+            image->read(devOffset, dest, length);
+        }
+
+        void write(std::int64_t, const char*, std::int64_t) override {
+            throw std::runtime_error("device is read only");
+        }
+
+        void willNeed(std::int64_t devOffset, std::int64_t length) override { image->willNeed(devOffset, length); }
+
+        const char* getMappedData(std::int64_t devOffset) override { return image->getMappedData(devOffset); }
+
+        std::shared_ptr<const char> getMapping() override { return image->getMapping(); }
+
+        int getFileDescriptor() override { return image->getFileDescriptor(); }
+
+        void flush() override {}
+
+        std::int32_t getSectorSize() override { return image->getSectorSize(); }
+
+        void close() override {
+            sidecar->close();
+            image->close();
+        }
+
+        bool isClosed() override { return image->isClosed(); }
+
+        bool isReadOnly() override { return true; }
+    };
+
+    static std::uint64_t hash(const char* data, std::int64_t length, std::uint64_t h = 14695981039346656037ull) {
+        for (std::int64_t i = 0; i < length; i++) {
+            h ^= static_cast<unsigned char>(data[i]);
+            h *= 1099511628211ull;
+        }
+
+        return h;
+    }
+
+    static std::int64_t getImageTime(const std::string& imagePath) {
+        return static_cast<std::int64_t>(std::filesystem::last_write_time(imagePath).time_since_epoch().count());
+    }
+
+    static std::vector<char> readRange(BlockDevice& device, std::int64_t devOffset, std::int64_t length) {
+        std::vector<char> data(length);
+        device.read(devOffset, data.data(), length);
+        return data;
+    }
+
+    // The FAT 0 region of the image behind bs
+    static std::pair<std::int64_t, std::int64_t> getFatRange(BootSector& bs) {
+        return {bs.getFatOffset(0), bs.getSectorsPerFat() * bs.getBytesPerSector()};
+    }
+
+public:
+    // Writes the sidecar of the image at imagePath, which fs has mounted. Replaces an
+    // existing sidecar atomically.
+    static void write(AkaiFatFileSystem& fs, const std::string& imagePath, const std::string& sidecarPath) {
+        auto bs = std::dynamic_pointer_cast<Fat16BootSector>(fs.getBootSector());
+        auto image = bs->getDevice();
+        auto root = std::dynamic_pointer_cast<AkaiFatLfnDirectory>(fs.getRoot());
+        auto fat = root->getFat();
+
+        std::set<std::int64_t> directoryClusters;
+
+        AkaiFatDirectoryWalker walker;
+        walker.setPreVisitor([&](const AkaiFatDirectoryWalker::Entry& entry, const std::string&, std::int32_t) {
+            if (entry->isDirectory() && entry->realEntry->getStartCluster() != 0)
+                directoryClusters.insert(entry->realEntry->getStartCluster());
+
+            return true;
+        });
+        walker.walk(root);
+
+        std::vector<std::pair<std::int64_t, std::int64_t>> regions;
+        regions.emplace_back(0, std::int64_t{BootSector::SIZE});
+
+        for (std::int32_t i = 0; i < bs->getNrFats(); i++)
+            regions.emplace_back(bs->getFatOffset(i), bs->getSectorsPerFat() * bs->getBytesPerSector());
+
+        regions.emplace_back(bs->getRootDirOffset(), bs->getRootDirEntryCount() * std::int64_t{FatDirectoryEntry::SIZE});
+
+        {
+            util::ReadLock lock(fat->getLock());
+
+            for (auto cluster : directoryClusters) {
+                ClusterChain chain(fat.get(), cluster, true);
+
+                for (auto& extent : chain.getExtents(0, chain.getLengthOnDisk()))
+                    regions.emplace_back(extent.devOffset, extent.length);
+            }
+        }
+
+        // Adjacent regions become one range, so reads that span them stay in the sidecar
+        std::sort(begin(regions), end(regions));
+        std::vector<Range> ranges;
+
+        for (auto& region : regions) {
+            if (!ranges.empty() && region.first <= ranges.back().devOffset + ranges.back().length) {
+                auto& last = ranges.back();
+                last.length = std::max(last.length, region.first + region.second - last.devOffset);
+                continue;
+            }
+
+            ranges.push_back({region.first, region.second, 0});
+        }
+
+        std::int64_t fileOffset = sizeof(Header) + ranges.size() * sizeof(Range);
+
+        for (auto& range : ranges) {
+            range.fileOffset = fileOffset;
+            fileOffset += range.length;
+        }
+
+        const auto bootSector = readRange(*image, 0, BootSector::SIZE);
+        const auto fatRange = getFatRange(*bs);
+        const auto fatData = readRange(*image, fatRange.first, fatRange.second);
+
+        Header header{};
+        std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.version = VERSION;
+        header.rangeCount = static_cast<std::uint32_t>(ranges.size());
+        header.imageSize = static_cast<std::int64_t>(std::filesystem::file_size(imagePath));
+        header.imageTime = getImageTime(imagePath);
+        header.bootSectorHash = hash(bootSector.data(), bootSector.size());
+        header.metadataHash = hash(fatData.data(), fatData.size(), header.bootSectorHash);
+
+        const auto tmpPath = sidecarPath + ".tmp";
+
+        {
+            std::ofstream out(tmpPath, std::ios_base::binary | std::ios_base::trunc);
+
+            if (!out) throw std::runtime_error("cannot open " + tmpPath);
+
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            out.write(reinterpret_cast<const char*>(ranges.data()), ranges.size() * sizeof(Range));
+
+            for (auto& range : ranges) {
+                auto data = readRange(*image, range.devOffset, range.length);
+                out.write(data.data(), data.size());
+            }
+
+            if (!out.flush()) throw std::runtime_error("cannot write " + tmpPath);
+        }
+
+        std::filesystem::rename(tmpPath, sidecarPath);
+    }
+
+    // Returns a read-only device that serves the metadata of the image from the sidecar,
+    // or nullptr if there is no sidecar or it does not match the image. With verifyFat the
+    // FAT is read from the image and hashed too.
+    static std::shared_ptr<BlockDevice> open(const std::shared_ptr<BlockDevice>& image, const std::string& imagePath,
+                                             const std::string& sidecarPath, bool verifyFat = false) {
+        std::error_code ec;
+        const auto sidecarSize = static_cast<std::int64_t>(std::filesystem::file_size(sidecarPath, ec));
+
+        if (ec || sidecarSize < static_cast<std::int64_t>(sizeof(Header))) return nullptr;
+
+        auto sidecar = std::make_shared<MappedImageBlockDevice>(sidecarPath, true);
+
+        Header header{};
+        sidecar->read(0, reinterpret_cast<char*>(&header), sizeof(header));
+
+        if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION) return nullptr;
+
+        if (header.imageSize != static_cast<std::int64_t>(std::filesystem::file_size(imagePath)) ||
+            header.imageTime != getImageTime(imagePath))
+            return nullptr;
+
+        const auto bootSector = readRange(*image, 0, BootSector::SIZE);
+        const auto bootSectorHash = hash(bootSector.data(), bootSector.size());
+
+        if (bootSectorHash != header.bootSectorHash) return nullptr;
+
+        if (verifyFat) {
+            auto bs = BootSector::read(image);
+            const auto fatRange = getFatRange(*bs);
+            const auto fatData = readRange(*image, fatRange.first, fatRange.second);
+
+            if (hash(fatData.data(), fatData.size(), bootSectorHash) != header.metadataHash) return nullptr;
+        }
+
+        const std::int64_t tableEnd = static_cast<std::int64_t>(sizeof(Header)) +
+                                      header.rangeCount * static_cast<std::int64_t>(sizeof(Range));
+
+        if (tableEnd > sidecarSize) return nullptr;
+
+        std::vector<Range> ranges(header.rangeCount);
+        sidecar->read(sizeof(Header), reinterpret_cast<char*>(ranges.data()), ranges.size() * sizeof(Range));
+
+        for (auto& range : ranges)
+            if (range.length < 0 || range.fileOffset < tableEnd || range.fileOffset + range.length > sidecarSize)
+                return nullptr;
+
+        return std::make_shared<Device>(image, sidecar, std::move(ranges));
+    }
+
+    // Mounts the image read-only through its sidecar. Writes the sidecar when it is missing
+    // or stale; failing to write it does not fail the mount. The sidecar is opened without
+    // verifyFat, so it is only checked against the size, modification time and boot sector
+    // of the image. Call open() with verifyFat to check the FAT as well.
+    static std::shared_ptr<AkaiFatFileSystem> mount(const std::shared_ptr<BlockDevice>& image, const std::string& imagePath,
+                                                    const std::string& sidecarPath) {
+        if (auto device = open(image, imagePath, sidecarPath))
+            return std::make_shared<AkaiFatFileSystem>(device, true);
+
+        auto fs = std::make_shared<AkaiFatFileSystem>(image, true);
+
+        try {
+            write(*fs, imagePath, sidecarPath);
+        } catch (const std::exception&) {
+            // The next mount tries again
+        }
+
+        return fs;
+    }
+};
+}
+
+#endif
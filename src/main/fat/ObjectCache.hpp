@@ -0,0 +1,147 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace akaifat::fat {
+
+class FatFile;
+class AkaiFatLfnDirectory;
+
+/*
+ * Keeps the most recently used files and subdirectories of a mount alive, up to a memory
+ * limit. Directories only refer to their cached files and subdirectories weakly, so whatever
+ * falls out of the LRU is freed once callers let go of it, and is read again when it is
+ * next asked for. Objects that callers still hold are found through the weak references,
+ * so there is never more than one object per directory entry.
+ *
+ * A directory refers to itself through its entries, so dropping it from the LRU does not
+ * free it. Evicted directories are kept on a list until AkaiFatFileSystem releases them
+ * with the file system lock held exclusively, see AkaiFatLfnDirectory::release().
+ */
+class ObjectCache {
+private:
+    struct Item {
+        std::shared_ptr<FatFile> file;
+        std::shared_ptr<AkaiFatLfnDirectory> directory;
+        std::int64_t cost;
+    };
+
+    using LruList = std::list<Item>;
+
+    std::mutex mutex;
+    std::int64_t limit;
+    std::int64_t usage = 0;
+    LruList lru;
+    std::unordered_map<const void *, LruList::iterator> index;
+    std::vector<std::weak_ptr<AkaiFatLfnDirectory>> evictedDirectories;
+
+    // Returns what was evicted, so the caller can free it after unlocking
+    LruList touch(const void *key, Item item) {
+        LruList evicted;
+        std::lock_guard<std::mutex> guard(mutex);
+        auto it = index.find(key);
+
+        if (it != end(index)) {
+            usage += item.cost - it->second->cost;
+            it->second->cost = item.cost;
+            lru.splice(begin(lru), lru, it->second);
+        } else {
+            usage += item.cost;
+            lru.push_front(std::move(item));
+            index[key] = begin(lru);
+        }
+
+        evict(evicted);
+        return evicted;
+    }
+
+    void evict(LruList &evicted) {
+        // The most recent object stays, however large it is
+        while (usage > limit && lru.size() > 1) {
+            auto &last = lru.back();
+            usage -= last.cost;
+            index.erase(last.file ? static_cast<const void *>(last.file.get()) : last.directory.get());
+
+            if (last.directory) evictedDirectories.push_back(last.directory);
+
+            evicted.splice(begin(evicted), lru, std::prev(end(lru)));
+        }
+    }
+
+public:
+    explicit ObjectCache(std::int64_t _limit) : limit(_limit) {}
+
+    void touch(const std::shared_ptr<FatFile> &file, std::int64_t cost) {
+        touch(file.get(), Item{file, nullptr, cost});
+    }
+
+    void touch(const std::shared_ptr<AkaiFatLfnDirectory> &directory, std::int64_t cost) {
+        touch(directory.get(), Item{nullptr, directory, cost});
+    }
+
+    void setLimit(std::int64_t bytes) {
+        LruList evicted;
+        std::lock_guard<std::mutex> guard(mutex);
+        limit = bytes;
+        evict(evicted);
+    }
+
+    std::int64_t getLimit() {
+        std::lock_guard<std::mutex> guard(mutex);
+        return limit;
+    }
+
+    // True if object is in the LRU, which then holds one reference to it
+    bool contains(const void *object) {
+        std::lock_guard<std::mutex> guard(mutex);
+        return index.find(object) != end(index);
+    }
+
+    // Estimated memory of the objects in the LRU
+    std::int64_t getUsage() {
+        std::lock_guard<std::mutex> guard(mutex);
+        return usage;
+    }
+
+    // Evicted directories that are still alive and not back in the LRU
+    std::vector<std::shared_ptr<AkaiFatLfnDirectory>> takeEvictedDirectories() {
+        std::lock_guard<std::mutex> guard(mutex);
+        std::vector<std::shared_ptr<AkaiFatLfnDirectory>> result;
+        std::unordered_set<const void *> seen;
+
+        for (auto &weak : evictedDirectories) {
+            auto directory = weak.lock();
+
+            if (directory && index.find(directory.get()) == end(index) && seen.insert(directory.get()).second)
+                result.push_back(std::move(directory));
+        }
+
+        evictedDirectories.clear();
+        return result;
+    }
+
+    void addEvictedDirectory(const std::shared_ptr<AkaiFatLfnDirectory> &directory) {
+        std::lock_guard<std::mutex> guard(mutex);
+        evictedDirectories.push_back(directory);
+    }
+
+    void clear() {
+        LruList evicted;
+        std::lock_guard<std::mutex> guard(mutex);
+
+        for (auto &item : lru)
+            if (item.directory) evictedDirectories.push_back(item.directory);
+
+        evicted.swap(lru);
+        index.clear();
+        usage = 0;
+    }
+};
+}
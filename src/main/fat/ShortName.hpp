@@ -4,6 +4,7 @@
 
 #include "LittleEndian.hpp"
 
+#include <array>
 #include <string>
 #include <vector>
 
@@ -20,13 +21,13 @@ namespace akaifat::fat {
 
         static const char ASCII_SPACE = 0x20;
 
-        std::vector<char> nameBytes;
+        std::array<char, 11> nameBytes{};
 
-        static std::vector<char> toCharArray(std::string &name, std::string &ext) {
+        static std::array<char, 11> toCharArray(std::string &name, std::string &ext) {
         checkValidName(name);
         checkValidExt(ext);
 
-            std::vector<char> result(11);
+            std::array<char, 11> result{};
             for (std::int32_t i = 0; i < 11; i++)
                 result[i] = ASCII_SPACE;
 
@@ -103,16 +104,31 @@ namespace akaifat::fat {
             else return ShortName(name);
         }
 
-        static bool canConvert(std::string nameExt) {
-            try {
-                ShortName::get(nameExt);
-                return true;
-            } catch (std::exception &) {
-                return false;
+        // Same outcome as trying ShortName::get(nameExt), without throwing for names that don't fit
+        static bool canConvert(const std::string &nameExt) {
+            if (nameExt == "." || nameExt == "..") return true;
+
+            if (nameExt.length() > 12) return false;
+
+            auto i = nameExt.find_last_of('.');
+            auto nameLength = i == std::string::npos ? nameExt.length() : i;
+            auto extLength = i == std::string::npos ? 0 : nameExt.length() - i - 1;
+
+            if (nameLength < 1 || nameLength > 8 || extLength > 3) return false;
+
+            if (nameExt[0] == ASCII_SPACE) return false;
+
+            for (size_t j = 0; j < nameExt.length(); j++) {
+                if (j == i) continue;
+
+                if (!isValidChar(static_cast<char>(toupper(static_cast<unsigned char>(nameExt[j]))))) return false;
             }
+
+            return true;
         }
 
-        static ShortName parse(std::vector<char> &data) {
+        template <typename Bytes>
+        static ShortName parse(const Bytes &data) {
             std::string name;
 
             for (std::int32_t i = 0; i < 8; i++)
@@ -133,7 +149,8 @@ namespace akaifat::fat {
             return {name, ext};
         }
 
-        void write(std::vector<char> &dest) {
+        template <typename Bytes>
+        void write(Bytes &dest) {
             for (std::int32_t i = 0; i < nameBytes.size(); i++)
                 dest[i] = nameBytes[i];
         }
@@ -165,7 +182,17 @@ namespace akaifat::fat {
             return ext.empty() ? name : (name + "." + ext);
         }
 
-        static void checkValidChars(std::vector<char> &chars) {
+        static bool isValidChar(char c) {
+            if (c < 0x20 && c != 0x05) return false;
+
+            for (char j : ILLEGAL_CHARS()) {
+                if (c == j) return false;
+            }
+
+            return true;
+        }
+
+        static void checkValidChars(const std::array<char, 11> &chars) {
 
             if (chars[0] == 0x20) throw std::runtime_error("0x20 can not be the first character");
 
@@ -187,12 +214,7 @@ namespace akaifat::fat {
         }
 
         bool equals(const ShortName &other) {
-            if (nameBytes.size() != other.nameBytes.size()) return false;
-
-            for (size_t i = 0; i < nameBytes.size(); i++)
-                if (nameBytes[i] != other.nameBytes[i]) return false;
-
-            return true;
+            return nameBytes == other.nameBytes;
         }
         
         char checkSum() {
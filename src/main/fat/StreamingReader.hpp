@@ -0,0 +1,215 @@
+#pragma once
+
+#include "FatFile.hpp"
+#include "ClusterChain.hpp"
+
+#include "../util/SpscRingBuffer.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace akaifat::fat {
+
+/*
+ * Streams a file into a ring buffer on a background thread, for consumers that must not
+ * block, like an audio callback. pull() is lock-free and does not allocate.
+ *
+ * The I/O thread reads straight from the file's device extents. It fills the buffer once
+ * when it starts, and refills it whenever the fill level drops below the low watermark.
+ * start() returns once the pre-roll is buffered.
+ *
+ * The file must not be written while it is streamed.
+ */
+class StreamingReader {
+private:
+    std::shared_ptr<FatFile> file;
+    std::shared_ptr<BlockDevice> device;
+    Fat *fat;
+    std::vector<ClusterChain::Extent> extents;
+    util::SpscRingBuffer<char> ring;
+
+    std::size_t preRoll;
+    std::size_t lowWatermark;
+    std::size_t maxReadSize;
+
+    std::thread ioThread;
+    std::mutex mutex;
+    std::condition_variable stateChanged;
+    std::atomic<bool> stopping{false};
+    std::atomic<bool> endOfFile{false};
+    std::exception_ptr error;
+
+    std::atomic<std::uint64_t> underrunCount{0};
+    std::atomic<std::uint64_t> underrunBytes{0};
+
+    // Fills the free space of the ring. Returns false at end of file.
+    bool fill(std::size_t &extentIdx, std::int64_t &extentPos) {
+        while (extentIdx < extents.size()) {
+            std::size_t len;
+            auto dest = ring.prepareWrite(len);
+
+            if (len == 0) return true;
+
+            auto &extent = extents[extentIdx];
+            const auto count = std::min<std::int64_t>({static_cast<std::int64_t>(len),
+                                                       static_cast<std::int64_t>(maxReadSize),
+                                                       extent.length - extentPos});
+
+            {
+                util::ReadLock fsLock(fat->getLock());
+                util::ReadLock fileLock(file->getLock());
+                device->read(extent.devOffset + extentPos, dest, count);
+            }
+
+            ring.commitWrite(count);
+            extentPos += count;
+
+            if (extentPos == extent.length) {
+                extentIdx++;
+                extentPos = 0;
+            }
+
+            if (ring.size() >= preRoll) {
+                // Taking the lock makes sure start() is either waiting or has not checked yet
+                { std::lock_guard<std::mutex> lock(mutex); }
+                stateChanged.notify_all();
+            }
+        }
+
+        return false;
+    }
+
+    void run() {
+        std::size_t extentIdx = 0;
+        std::int64_t extentPos = 0;
+        // fill() only returns early at the end of the file, so the first pass covers the pre-roll
+        bool primed = false;
+
+        try {
+            while (!stopping) {
+                if (!primed || ring.size() < lowWatermark) {
+                    primed = true;
+
+                    if (!fill(extentIdx, extentPos)) break;
+
+                    continue;
+                }
+
+                std::unique_lock<std::mutex> lock(mutex);
+                stateChanged.wait_for(lock, std::chrono::milliseconds(2), [this] { return stopping.load(); });
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            error = std::current_exception();
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            endOfFile = true;
+        }
+
+        stateChanged.notify_all();
+    }
+
+public:
+    // Streams [offset, end of file) through a buffer of bufferSize bytes
+    StreamingReader(std::shared_ptr<FatFile> _file, std::size_t bufferSize, std::int64_t offset = 0)
+    : file(std::move(_file)), ring(bufferSize) {
+        auto &chain = file->getChain();
+        device = chain.getDevice();
+        fat = chain.getFat();
+        extents = chain.getExtents(offset, file->getLength() - offset);
+
+        preRoll = ring.capacity() / 2;
+        lowWatermark = ring.capacity() / 2;
+        maxReadSize = static_cast<std::size_t>(chain.getClusterSize()) * 8;
+    }
+
+    StreamingReader(const StreamingReader &) = delete;
+    StreamingReader &operator=(const StreamingReader &) = delete;
+
+    ~StreamingReader() {
+        stop();
+    }
+
+    // Bytes that must be buffered before start() returns. Capped at the buffer size.
+    void setPreRoll(std::size_t bytes) {
+        preRoll = std::min(bytes, ring.capacity());
+    }
+
+    // The I/O thread refills when fewer bytes than this are buffered, independently of the
+    // pre-roll. At least 1, so an empty buffer is always refilled.
+    void setLowWatermark(std::size_t bytes) {
+        lowWatermark = std::clamp<std::size_t>(bytes, 1, ring.capacity());
+    }
+
+    // Upper bound of a single device read
+    void setMaxReadSize(std::size_t bytes) {
+        maxReadSize = std::max<std::size_t>(bytes, 512);
+    }
+
+    // Starts the I/O thread and waits for the pre-roll, the end of the file or an error
+    void start() {
+        if (ioThread.joinable()) return;
+
+        ioThread = std::thread([this] { run(); });
+
+        std::unique_lock<std::mutex> lock(mutex);
+        stateChanged.wait(lock, [this] { return ring.size() >= preRoll || endOfFile; });
+
+        if (error) std::rethrow_exception(error);
+    }
+
+    void stop() {
+        if (!ioThread.joinable()) return;
+
+        stopping = true;
+        stateChanged.notify_all();
+        ioThread.join();
+    }
+
+    // Called by the consumer. Copies up to n bytes and returns how many were available.
+    // Getting fewer than n bytes before the end of the file counts as an underrun.
+    std::size_t pull(char *dest, std::size_t n) {
+        const auto count = ring.read(dest, n);
+
+        if (count < n && !endOfFile.load(std::memory_order_acquire)) {
+            underrunCount.fetch_add(1, std::memory_order_relaxed);
+            underrunBytes.fetch_add(n - count, std::memory_order_relaxed);
+        }
+
+        return count;
+    }
+
+    std::size_t getBuffered() const {
+        return ring.size();
+    }
+
+    // True once the whole file was pulled, or the I/O thread stopped on an error
+    bool isFinished() const {
+        return endOfFile.load(std::memory_order_acquire) && ring.size() == 0;
+    }
+
+    std::uint64_t getUnderrunCount() const {
+        return underrunCount.load(std::memory_order_relaxed);
+    }
+
+    std::uint64_t getUnderrunBytes() const {
+        return underrunBytes.load(std::memory_order_relaxed);
+    }
+
+    // The error that stopped the I/O thread, if any
+    std::exception_ptr getError() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return error;
+    }
+};
+}
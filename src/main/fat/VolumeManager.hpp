@@ -0,0 +1,222 @@
+#pragma once
+
+#include "AkaiFatFileSystem.hpp"
+
+#if defined (__linux__) || defined (__APPLE__)
+#include "../MappedImageBlockDevice.hpp"
+#endif
+
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+namespace akaifat::fat {
+
+/*
+ * Keeps images mounted on behalf of many callers. Opening an image that is already mounted
+ * returns the same AkaiFatFileSystem, so all callers share one FAT and one set of cached
+ * directories. The memory of all mounts, as estimated by AkaiFatFileSystem::getMemoryUsage(),
+ * is kept within one budget by flushing and unmounting the least recently opened volumes
+ * that are idle. Volumes in use are never unmounted, so the budget can be exceeded while they
+ * are.
+ *
+ * A volume is in use while a caller holds its file system, or directories, entries, files,
+ * streams or views obtained from it, see AkaiFatFileSystem::isInUse().
+ */
+class VolumeManager {
+public:
+    using DeviceFactory = std::function<std::shared_ptr<BlockDevice>(const std::string &path, bool readOnly)>;
+
+private:
+    struct Volume {
+        std::shared_ptr<AkaiFatFileSystem> fs;
+        std::shared_ptr<BlockDevice> device;
+        std::list<std::string>::iterator lruPosition;
+    };
+
+    using Volumes = std::map<std::string, Volume>;
+
+    std::mutex mutex;
+    std::int64_t memoryBudget;
+    DeviceFactory deviceFactory;
+    // Keys of the mounted volumes, most recently opened first
+    std::list<std::string> lru;
+    Volumes volumes;
+
+    static std::shared_ptr<BlockDevice> openImage(const std::string &path, bool readOnly) {
+#if defined (__linux__) || defined (__APPLE__)
+        return std::make_shared<MappedImageBlockDevice>(path, readOnly);
+#else
+        throw std::runtime_error("no device factory to open " + path);
+#endif
+    }
+
+    // Different spellings of the same path share a mount
+    static std::string getKey(const std::string &path) {
+        std::error_code ec;
+        auto canonical = std::filesystem::weakly_canonical(path, ec);
+        return ec ? path : canonical.string();
+    }
+
+    // Only the manager holds the file system, and nothing obtained from it is alive
+    static bool isIdle(const Volume &volume) {
+        return volume.fs.use_count() == 1 && !volume.fs->isInUse();
+    }
+
+    void unmount(Volumes::iterator it) {
+        auto &volume = it->second;
+
+        // Stays mounted if flushing fails, so the changes are not lost
+        volume.fs->close();
+        volume.device->flush();
+        volume.device->close();
+
+        lru.erase(volume.lruPosition);
+        volumes.erase(it);
+    }
+
+    std::int64_t getMemoryUsageLocked() {
+        std::int64_t result = 0;
+
+        for (auto &v : volumes)
+            result += v.second.fs->getMemoryUsage();
+
+        return result;
+    }
+
+    void trimLocked() {
+        auto usage = getMemoryUsageLocked();
+
+        for (auto key = lru.rbegin(); key != lru.rend() && usage > memoryBudget;) {
+            auto it = volumes.find(*key);
+            ++key;
+
+            if (!isIdle(it->second)) continue;
+
+            usage -= it->second.fs->getMemoryUsage();
+            unmount(it);
+        }
+    }
+
+public:
+    explicit VolumeManager(std::int64_t _memoryBudget, DeviceFactory _deviceFactory = openImage)
+    : memoryBudget(_memoryBudget), deviceFactory(std::move(_deviceFactory)) {}
+
+    VolumeManager(const VolumeManager &) = delete;
+    VolumeManager &operator=(const VolumeManager &) = delete;
+
+    // Calls closeAll() on a best-effort basis: errors are dropped, so call closeAll() first to
+    // see them.
+    ~VolumeManager() {
+        try {
+            closeAll();
+        } catch (const std::exception&) {
+            // A destructor must not throw
+        }
+    }
+
+    // Returns the mount of the image at path, mounting it if needed. A writable mount is
+    // returned for read-only requests too. A read-only mount is remounted writable if it is
+    // idle; if it is in use, asking for write access throws.
+    std::shared_ptr<AkaiFatFileSystem> open(const std::string &path, bool readOnly) {
+        std::lock_guard<std::mutex> guard(mutex);
+        const auto key = getKey(path);
+        auto it = volumes.find(key);
+
+        if (it != end(volumes)) {
+            auto &volume = it->second;
+
+            if (readOnly || !volume.fs->isReadOnly()) {
+                lru.splice(begin(lru), lru, volume.lruPosition);
+                return volume.fs;
+            }
+
+            if (!isIdle(volume)) throw std::runtime_error(path + " is mounted read-only");
+
+            unmount(it);
+        }
+
+        auto device = deviceFactory(key, readOnly);
+        auto fs = std::make_shared<AkaiFatFileSystem>(device, readOnly);
+
+        lru.push_front(key);
+        volumes[key] = Volume{fs, device, begin(lru)};
+
+        trimLocked();
+        return fs;
+    }
+
+    // Flushes and unmounts the image at path. Returns false if it is not mounted or in use.
+    bool close(const std::string &path) {
+        std::lock_guard<std::mutex> guard(mutex);
+        auto it = volumes.find(getKey(path));
+
+        if (it == end(volumes) || !isIdle(it->second)) return false;
+
+        unmount(it);
+        return true;
+    }
+
+    // Flushes and unmounts the idle volumes and flushes the writable ones still in use. Every
+    // volume is attempted; the first error is rethrown afterwards, and a volume whose flush
+    // failed stays mounted.
+    void closeAll() {
+        std::lock_guard<std::mutex> guard(mutex);
+        std::exception_ptr error;
+
+        for (auto it = begin(volumes); it != end(volumes);) {
+            auto next = std::next(it);
+
+            try {
+                if (isIdle(it->second))
+                    unmount(it);
+                else if (!it->second.fs->isReadOnly())
+                    it->second.fs->flush();
+            } catch (const std::exception&) {
+                if (!error) error = std::current_exception();
+            }
+
+            it = next;
+        }
+
+        if (error) std::rethrow_exception(error);
+    }
+
+    bool isOpen(const std::string &path) {
+        std::lock_guard<std::mutex> guard(mutex);
+        return volumes.find(getKey(path)) != end(volumes);
+    }
+
+    std::size_t getOpenCount() {
+        std::lock_guard<std::mutex> guard(mutex);
+        return volumes.size();
+    }
+
+    // Estimated memory of all mounts
+    std::int64_t getMemoryUsage() {
+        std::lock_guard<std::mutex> guard(mutex);
+        return getMemoryUsageLocked();
+    }
+
+    void setMemoryBudget(std::int64_t bytes) {
+        std::lock_guard<std::mutex> guard(mutex);
+        memoryBudget = bytes;
+        trimLocked();
+    }
+
+    // Unmounts idle volumes, least recently opened first, until the budget is met. Callers
+    // that release a volume call this to give its memory back.
+    void trim() {
+        std::lock_guard<std::mutex> guard(mutex);
+        trimLocked();
+    }
+};
+}
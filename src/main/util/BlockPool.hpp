@@ -0,0 +1,112 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+namespace akaifat::util {
+
+/*
+ * Hands out fixed-size blocks carved from larger chunks and keeps released blocks on a
+ * free list. The block size is taken from the first allocation; requests of any other size
+ * go to the global heap. Memory is returned to the heap when the pool is destroyed.
+ */
+class BlockPool {
+private:
+    struct FreeBlock {
+        FreeBlock *next;
+    };
+
+    static const std::size_t BLOCKS_PER_CHUNK = 64;
+
+    std::mutex mutex;
+    std::size_t blockSize = 0;
+    std::vector<std::unique_ptr<char[]>> chunks;
+    FreeBlock *freeList = nullptr;
+
+    static std::size_t roundUp(std::size_t size) {
+        const std::size_t alignment = alignof(std::max_align_t);
+        return ((std::max(size, sizeof(FreeBlock)) + alignment - 1) / alignment) * alignment;
+    }
+
+    void addChunk() {
+        // new char[] is aligned for any fundamental type, and blockSize is a multiple of that alignment
+        chunks.emplace_back(new char[blockSize * BLOCKS_PER_CHUNK]);
+        auto chunk = chunks.back().get();
+
+        for (std::size_t i = 0; i < BLOCKS_PER_CHUNK; i++) {
+            auto block = reinterpret_cast<FreeBlock *>(chunk + i * blockSize);
+            block->next = freeList;
+            freeList = block;
+        }
+    }
+
+public:
+    BlockPool() = default;
+    BlockPool(const BlockPool &) = delete;
+    BlockPool &operator=(const BlockPool &) = delete;
+
+    void *allocate(std::size_t size) {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (blockSize == 0) blockSize = roundUp(size);
+
+        if (roundUp(size) != blockSize) return ::operator new(size);
+
+        if (freeList == nullptr) addChunk();
+
+        auto block = freeList;
+        freeList = block->next;
+        return block;
+    }
+
+    void deallocate(void *p, std::size_t size) {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (roundUp(size) != blockSize) {
+            ::operator delete(p);
+            return;
+        }
+
+        auto block = static_cast<FreeBlock *>(p);
+        block->next = freeList;
+        freeList = block;
+    }
+
+    std::size_t getChunkCount() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return chunks.size();
+    }
+};
+
+// Allocator for std::allocate_shared. Every allocation keeps the pool alive.
+template <typename T>
+class PoolAllocator {
+public:
+    using value_type = T;
+
+    std::shared_ptr<BlockPool> pool;
+
+    explicit PoolAllocator(std::shared_ptr<BlockPool> _pool) : pool(std::move(_pool)) {}
+
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U> &other) : pool(other.pool) {}
+
+    T *allocate(std::size_t n) {
+        return static_cast<T *>(pool->allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T *p, std::size_t n) {
+        pool->deallocate(p, n * sizeof(T));
+    }
+
+    template <typename U>
+    bool operator==(const PoolAllocator<U> &other) const { return pool == other.pool; }
+
+    template <typename U>
+    bool operator!=(const PoolAllocator<U> &other) const { return pool != other.pool; }
+};
+}
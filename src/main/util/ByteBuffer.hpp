@@ -2,6 +2,7 @@
 
 #include "../fat/LittleEndian.hpp"
 
+#include <algorithm>
 #include <vector>
 #include <stdexcept>
 
@@ -16,6 +17,7 @@ public:
     ByteBuffer(std::int64_t size)
     : buf (std::vector<char>(size)), limit_ (size) {}
     ByteBuffer(std::vector<char>& data) : buf (data), limit_ (data.size()) {}
+    ByteBuffer(std::vector<char>&& data) : buf (std::move(data)), limit_ (buf.size()) {}
 
     void clearAndAllocate(std::int64_t newSize) { buf.clear(); pos = 0; limit_ = newSize; buf.resize(newSize); }
     
@@ -29,29 +31,38 @@ public:
         }
     }
     
+    void get(char* dest, std::int64_t length) {
+        if (pos + length > static_cast<std::int64_t>(buf.size())) throw std::runtime_error("invalid bytebuffer read");
+        std::copy(buf.data() + pos, buf.data() + pos + length, dest);
+        pos += length;
+    }
+
     char get() { return buf[pos++]; }
     char get(std::int64_t index) { return buf[index]; }
 
     std::uint32_t getInt() {
-        return getInt(pos);
+        auto result = getInt(pos);
+        pos += 4;
+        return result;
     }
     
+    // Like get(index), the absolute getters leave the position alone, so concurrent readers
+    // of a shared buffer do not write to it
     std::uint32_t getInt(std::int64_t index) {
         char chars[4];
         for (std::int32_t i = 0; i < 4; i++)
             chars[i] = buf[index + i];
-        pos += 4;
         return *(std::uint32_t *) chars;
     }
     
     short getShort() {
-        return getShort(pos);
+        auto result = getShort(pos);
+        pos += 2;
+        return result;
     }
     
     short getShort(std::int64_t index) {
-        short result = (buf[index] & 0xff) | (buf[index + 1] << 8);
-        pos += 2;
-        return result;
+        return (buf[index] & 0xff) | (buf[index + 1] << 8);
     }
     
     std::int64_t position() { return pos; }
@@ -80,6 +91,12 @@ public:
         }
     }
     
+    void put(const char* data, std::int64_t length) {
+        if (pos + length > static_cast<std::int64_t>(buf.size())) throw std::runtime_error("invalid bytebuffer write");
+        std::copy(data, data + length, buf.data() + pos);
+        pos += length;
+    }
+
     std::vector<char>& getBuffer() { return buf; }
     std::int64_t capacity() { return buf.size(); }
 
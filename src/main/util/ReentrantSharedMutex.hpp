@@ -0,0 +1,108 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace akaifat::util {
+
+/*
+ * Reader-writer lock that the owning thread may lock again. A thread holding it exclusively
+ * can take it exclusively or shared again, and a thread holding it shared can take it shared
+ * again. Taking it exclusively while only holding it shared would deadlock and throws instead.
+ *
+ * Works with std::unique_lock and std::shared_lock.
+ */
+class ReentrantSharedMutex {
+private:
+    struct Held {
+        const ReentrantSharedMutex *mutex;
+        std::size_t depth;
+    };
+
+    std::shared_mutex mutex;
+    std::atomic<std::thread::id> owner{};
+    // Only touched by the owner
+    std::size_t exclusiveDepth = 0;
+
+    static std::vector<Held> &sharedHeld() {
+        thread_local std::vector<Held> held;
+        return held;
+    }
+
+    std::vector<Held>::iterator findShared() {
+        auto &held = sharedHeld();
+        return std::find_if(begin(held), end(held), [this](const Held &h) { return h.mutex == this; });
+    }
+
+    bool isOwner() const {
+        return owner.load(std::memory_order_relaxed) == std::this_thread::get_id();
+    }
+
+public:
+    ReentrantSharedMutex() = default;
+    ReentrantSharedMutex(const ReentrantSharedMutex &) = delete;
+    ReentrantSharedMutex &operator=(const ReentrantSharedMutex &) = delete;
+
+    void lock() {
+        if (isOwner()) {
+            exclusiveDepth++;
+            return;
+        }
+
+        if (findShared() != end(sharedHeld()))
+            throw std::logic_error("cannot take a write lock while holding a read lock");
+
+        mutex.lock();
+        owner.store(std::this_thread::get_id(), std::memory_order_relaxed);
+        exclusiveDepth = 1;
+    }
+
+    void unlock() {
+        if (--exclusiveDepth > 0) return;
+
+        owner.store(std::thread::id(), std::memory_order_relaxed);
+        mutex.unlock();
+    }
+
+    void lock_shared() {
+        // The exclusive lock covers reading as well
+        if (isOwner()) {
+            exclusiveDepth++;
+            return;
+        }
+
+        auto held = findShared();
+
+        if (held != end(sharedHeld())) {
+            held->depth++;
+            return;
+        }
+
+        mutex.lock_shared();
+        sharedHeld().push_back({this, 1});
+    }
+
+    void unlock_shared() {
+        if (isOwner()) {
+            unlock();
+            return;
+        }
+
+        auto held = findShared();
+
+        if (--held->depth > 0) return;
+
+        sharedHeld().erase(held);
+        mutex.unlock_shared();
+    }
+};
+
+using ReadLock = std::shared_lock<ReentrantSharedMutex>;
+using WriteLock = std::unique_lock<ReentrantSharedMutex>;
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include "ThreadPool.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace akaifat::util {
+
+/*
+ * Runs tasks one at a time, in submission order, on a shared ThreadPool. At most one
+ * worker of the pool is busy with a queue at any moment, so tasks on the same queue never
+ * run concurrently.
+ */
+class SerialQueue : public std::enable_shared_from_this<SerialQueue> {
+private:
+    ThreadPool &pool;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable spaceAvailable;
+    std::size_t maxQueued;
+    bool running = false;
+    // The worker that runs drain(), while running
+    std::thread::id drainingThread;
+
+    // Drains the queue on a pool worker. Never submits to the pool itself, so a full
+    // pool queue cannot block a worker.
+    void drain() {
+        while (true) {
+            std::function<void()> task;
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+
+                if (tasks.empty()) {
+                    running = false;
+                    drainingThread = std::thread::id();
+                    return;
+                }
+
+                drainingThread = std::this_thread::get_id();
+
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+
+            spaceAvailable.notify_one();
+            task();
+        }
+    }
+
+public:
+    // submit() blocks while maxQueued tasks are waiting. 0 for an unbounded queue. Tasks
+    // submitted by a task of this queue, e.g. from a completion callback, never wait: the
+    // thread that would make room is the one submitting.
+    SerialQueue(ThreadPool &_pool, std::size_t _maxQueued) : pool(_pool), maxQueued(_maxQueued) {}
+
+    SerialQueue(const SerialQueue &) = delete;
+    SerialQueue &operator=(const SerialQueue &) = delete;
+
+    template <typename F>
+    auto submit(F &&f) -> std::future<decltype(f())> {
+        auto task = std::make_shared<std::packaged_task<decltype(f())()>>(std::forward<F>(f));
+        auto result = task->get_future();
+        bool start = false;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            const bool draining = running && drainingThread == std::this_thread::get_id();
+            spaceAvailable.wait(lock, [this, draining] { return draining || maxQueued == 0 || tasks.size() < maxQueued; });
+            tasks.emplace_back([task] { (*task)(); });
+
+            if (!running) {
+                running = true;
+                start = true;
+            }
+        }
+
+        if (start) {
+            auto self = shared_from_this();
+            pool.submit([self] { self->drain(); });
+        }
+
+        return result;
+    }
+};
+
+// Workers shared by the asynchronous I/O of all file systems
+inline ThreadPool &getIoPool() {
+    static ThreadPool pool(2, 256);
+    return pool;
+}
+}
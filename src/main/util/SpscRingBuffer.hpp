@@ -0,0 +1,95 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+namespace akaifat::util {
+
+/*
+ * Lock-free ring buffer for exactly one producer thread and one consumer thread.
+ * Neither side blocks or allocates. The producer can fill the buffer in place with
+ * prepareWrite()/commitWrite().
+ */
+template <typename T>
+class SpscRingBuffer {
+private:
+    std::vector<T> data;
+    std::size_t mask;
+    // Total number of elements written and read. Only the producer stores head, only the
+    // consumer stores tail.
+    std::atomic<std::size_t> head{0};
+    std::atomic<std::size_t> tail{0};
+
+    static std::size_t roundUpToPowerOfTwo(std::size_t n) {
+        std::size_t result = 1;
+        while (result < n) result <<= 1;
+        return result;
+    }
+
+public:
+    // The capacity is rounded up to a power of two
+    explicit SpscRingBuffer(std::size_t capacity)
+    : data(roundUpToPowerOfTwo(std::max<std::size_t>(capacity, 1))), mask(data.size() - 1) {}
+
+    SpscRingBuffer(const SpscRingBuffer &) = delete;
+    SpscRingBuffer &operator=(const SpscRingBuffer &) = delete;
+
+    std::size_t capacity() const {
+        return data.size();
+    }
+
+    // Elements available to the consumer
+    std::size_t size() const {
+        return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+    }
+
+    // Producer: contiguous free space at the write position. len receives its length,
+    // which may be less than the total free space when the space wraps around.
+    T *prepareWrite(std::size_t &len) {
+        const auto h = head.load(std::memory_order_relaxed);
+        const auto free = data.size() - (h - tail.load(std::memory_order_acquire));
+        len = std::min(free, data.size() - (h & mask));
+        return data.data() + (h & mask);
+    }
+
+    // Producer: publishes n elements written through prepareWrite()
+    void commitWrite(std::size_t n) {
+        head.store(head.load(std::memory_order_relaxed) + n, std::memory_order_release);
+    }
+
+    // Producer: copies up to n elements in, returns how many fit
+    std::size_t write(const T *src, std::size_t n) {
+        std::size_t written = 0;
+
+        while (written < n) {
+            std::size_t len;
+            auto dest = prepareWrite(len);
+
+            if (len == 0) break;
+
+            len = std::min(len, n - written);
+            std::copy_n(src + written, len, dest);
+            commitWrite(len);
+            written += len;
+        }
+
+        return written;
+    }
+
+    // Consumer: copies up to n elements out, returns how many were available
+    std::size_t read(T *dest, std::size_t n) {
+        const auto t = tail.load(std::memory_order_relaxed);
+        const auto available = head.load(std::memory_order_acquire) - t;
+        const auto count = std::min(n, available);
+        const auto first = std::min(count, data.size() - (t & mask));
+
+        std::copy_n(data.data() + (t & mask), first, dest);
+        std::copy_n(data.data(), count - first, dest + first);
+
+        tail.store(t + count, std::memory_order_release);
+        return count;
+    }
+};
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace akaifat::util {
+class ThreadPool {
+private:
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable taskAvailable;
+    std::condition_variable spaceAvailable;
+    // 0 for an unbounded queue
+    std::size_t maxQueued;
+    bool stopping = false;
+
+    void run() {
+        while (true) {
+            std::function<void()> task;
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                taskAvailable.wait(lock, [this] { return stopping || !tasks.empty(); });
+
+                if (tasks.empty()) return;
+
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+
+            spaceAvailable.notify_one();
+
+            task();
+        }
+    }
+
+public:
+    // With maxQueued > 0, submit() blocks while that many tasks are waiting
+    explicit ThreadPool(std::size_t threadCount, std::size_t _maxQueued = 0) : maxQueued(_maxQueued) {
+        if (threadCount == 0) threadCount = 1;
+
+        for (std::size_t i = 0; i < threadCount; i++)
+            workers.emplace_back([this] { run(); });
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    // Runs the tasks that are still queued, then joins the workers
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+
+        taskAvailable.notify_all();
+
+        for (auto &worker : workers)
+            worker.join();
+    }
+
+    std::size_t getThreadCount() const {
+        return workers.size();
+    }
+
+    template <typename F>
+    auto submit(F &&f) -> std::future<decltype(f())> {
+        auto task = std::make_shared<std::packaged_task<decltype(f())()>>(std::forward<F>(f));
+        auto result = task->get_future();
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            spaceAvailable.wait(lock, [this] { return maxQueued == 0 || tasks.size() < maxQueued; });
+            tasks.emplace_back([task] { (*task)(); });
+        }
+
+        taskAvailable.notify_one();
+        return result;
+    }
+};
+}
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace akaifat::util {
+
+struct TraceEvent {
+    // A string literal naming the operation, e.g. "Fat::read"
+    const char *name;
+    // Steady clock time
+    std::uint64_t startNs;
+    std::uint64_t durationNs;
+    // Small number identifying the thread, see Trace::getThreadId()
+    std::uint64_t threadId;
+    // Device or file range the operation worked on, -1 if it has none
+    std::int64_t offset;
+    std::int64_t length;
+};
+
+class TraceSink {
+public:
+    virtual ~TraceSink() = default;
+
+    // Called on the thread that ran the operation, when it ends. Sinks are called from
+    // several threads at once.
+    virtual void record(const TraceEvent &event) = 0;
+};
+
+/*
+ * Process-wide tracing switch. While no sink is installed, a traced scope costs one relaxed
+ * load.
+ */
+class Trace {
+private:
+    struct State {
+        std::atomic<bool> active{false};
+        // Only accessed through std::atomic_load and std::atomic_store
+        std::shared_ptr<TraceSink> sink;
+    };
+
+    static State &getState() {
+        static State state;
+        return state;
+    }
+
+public:
+    // nullptr stops tracing. Operations that are running when the sink changes report to
+    // the sink they started with.
+    static void setSink(std::shared_ptr<TraceSink> sink) {
+        auto &state = getState();
+        state.active.store(sink != nullptr, std::memory_order_relaxed);
+        std::atomic_store(&state.sink, std::move(sink));
+    }
+
+    static std::shared_ptr<TraceSink> getSink() {
+        auto &state = getState();
+
+        if (!state.active.load(std::memory_order_relaxed)) return {};
+
+        return std::atomic_load(&state.sink);
+    }
+
+    static std::uint64_t now() {
+        return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+
+    // Threads are numbered in the order they first trace something
+    static std::uint64_t getThreadId() {
+        static std::atomic<std::uint64_t> nextId{1};
+        thread_local const std::uint64_t id = nextId.fetch_add(1, std::memory_order_relaxed);
+        return id;
+    }
+};
+
+// Reports the time from construction to destruction to the installed sink
+class TraceScope {
+private:
+    std::shared_ptr<TraceSink> sink;
+    const char *name;
+    std::int64_t offset;
+    std::int64_t length;
+    std::uint64_t startNs = 0;
+
+public:
+    explicit TraceScope(const char *_name, std::int64_t _offset = -1, std::int64_t _length = -1)
+    : sink(Trace::getSink()), name(_name), offset(_offset), length(_length) {
+        if (sink) startNs = Trace::now();
+    }
+
+    TraceScope(const TraceScope &) = delete;
+    TraceScope &operator=(const TraceScope &) = delete;
+
+    ~TraceScope() {
+        if (sink) sink->record({name, startNs, Trace::now() - startNs, Trace::getThreadId(), offset, length});
+    }
+};
+
+/*
+ * Collects events and writes them in the Chrome trace event format, for chrome://tracing
+ * or Perfetto. Events beyond the limit are dropped and counted.
+ */
+class ChromeTraceSink : public TraceSink {
+private:
+    std::mutex mutex;
+    std::vector<TraceEvent> events;
+    std::size_t maxEvents;
+    std::uint64_t droppedCount = 0;
+
+public:
+    explicit ChromeTraceSink(std::size_t _maxEvents = 1000000) : maxEvents(_maxEvents) {}
+
+    void record(const TraceEvent &event) override {
+        std::lock_guard<std::mutex> guard(mutex);
+
+        if (events.size() < maxEvents)
+            events.push_back(event);
+        else
+            droppedCount++;
+    }
+
+    std::size_t getEventCount() {
+        std::lock_guard<std::mutex> guard(mutex);
+        return events.size();
+    }
+
+    std::uint64_t getDroppedCount() {
+        std::lock_guard<std::mutex> guard(mutex);
+        return droppedCount;
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> guard(mutex);
+        events.clear();
+        droppedCount = 0;
+    }
+
+    // Every event becomes a complete ("X") event with times in microseconds
+    void write(std::ostream &out) {
+        std::lock_guard<std::mutex> guard(mutex);
+
+        out << "{\"traceEvents\": [";
+
+        const auto flags = out.flags();
+        out << std::fixed << std::setprecision(3);
+
+        for (std::size_t i = 0; i < events.size(); i++) {
+            auto &e = events[i];
+
+            out << (i == 0 ? "\n" : ",\n")
+                << "{\"name\": \"" << e.name << "\", \"cat\": \"akaifat\", \"ph\": \"X\""
+                << ", \"ts\": " << e.startNs / 1000.0
+                << ", \"dur\": " << e.durationNs / 1000.0
+                << ", \"pid\": 1, \"tid\": " << e.threadId;
+
+            if (e.offset >= 0)
+                out << ", \"args\": {\"offset\": " << e.offset << ", \"length\": " << e.length << "}";
+
+            out << "}";
+        }
+
+        out.flags(flags);
+        out << "\n], \"displayTimeUnit\": \"ms\"}\n";
+    }
+
+    void save(const std::string &path) {
+        std::ofstream out(path, std::ios_base::trunc);
+
+        if (!out) throw std::runtime_error("cannot open " + path);
+
+        write(out);
+
+        if (!out.flush()) throw std::runtime_error("cannot write " + path);
+    }
+};
+}
@@ -0,0 +1,383 @@
+#include "catch2/catch_test_macros.hpp"
+
+#include "test.hpp"
+
+#include "fat/AkaiFatLfnDirectoryEntry.hpp"
+#include "fat/AkaiFatDirectoryWalker.hpp"
+#include "fat/MetadataSidecar.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <thread>
+
+using namespace akaifat;
+using namespace akaifat::fat;
+
+TEST_CASE_METHOD(AkaiFatTestsFixture, "AkaiFatLfnDirectory::addFiles", "[directory]")
+{
+    std::string dirName = "BATCH";
+    root->addDirectory(dirName);
+    auto dir = std::dynamic_pointer_cast<AkaiFatLfnDirectory>(root->getEntry(dirName)->getDirectory());
+
+    std::vector<std::string> names;
+
+    for (int i = 0; i < 100; i++)
+        names.push_back("SAMPLE_NR_" + std::to_string(i) + ".SND");
+
+    auto entries = dir->addFiles(names);
+    REQUIRE(entries.size() == names.size());
+
+    std::vector<std::string> duplicate{"OTHER.SND", "SAMPLE_NR_5.SND"};
+    bool threw = false;
+
+    try {
+        dir->addFiles(duplicate);
+    } catch (const std::exception&) {
+        threw = true;
+    }
+
+    REQUIRE(threw);
+    REQUIRE(!dir->getEntry(duplicate[0]));
+
+    close();
+    init(false);
+
+    dir = std::dynamic_pointer_cast<AkaiFatLfnDirectory>(root->getEntry(dirName)->getDirectory());
+
+    for (auto& name : names) {
+        auto entry = dir->getEntry(name);
+        REQUIRE(entry);
+        REQUIRE(entry->getName() == name);
+        REQUIRE(entry->isFile());
+    }
+}
+
+TEST_CASE_METHOD(AkaiFatTestsFixture, "AkaiFatLfnDirectory batch remove and rename", "[directory]")
+{
+    std::vector<std::string> names{"KICK.SND", "SNARE.SND", "HIHAT.SND", "CRASH.SND"};
+    root->addFiles(names);
+
+    root->beginBatch();
+    root->remove(names[0]);
+    std::string newName = "RENAMED_SNARE.SND";
+    root->getEntry(names[1])->setName(newName);
+    root->commitBatch();
+
+    close();
+    init(false);
+
+    REQUIRE(!root->getEntry(names[0]));
+    REQUIRE(!root->getEntry(names[1]));
+    REQUIRE(root->getEntry(newName));
+    REQUIRE(root->getEntry(names[2]));
+    REQUIRE(root->getEntry(names[3]));
+}
+
+TEST_CASE_METHOD(AkaiFatTestsFixture, "AkaiFatLfnDirectory snapshots", "[directory]")
+{
+    std::string dirName = "LISTING";
+    root->addDirectory(dirName);
+    auto dir = std::dynamic_pointer_cast<AkaiFatLfnDirectory>(root->getEntry(dirName)->getDirectory());
+
+    REQUIRE(dir->getSnapshot()->items.empty());
+
+    std::string first = "FIRST.SND";
+    dir->addFile(first);
+    auto before = dir->getSnapshot();
+    REQUIRE(before->items.size() == 1);
+    REQUIRE(before->items[0].name == first);
+
+    // Batched changes appear at commitBatch()
+    std::string second = "SECOND.SND";
+    dir->beginBatch();
+    dir->addFile(second);
+    REQUIRE(dir->getSnapshot() == before);
+    dir->commitBatch();
+
+    auto after = dir->getSnapshot();
+    REQUIRE(after->items.size() == 2);
+    REQUIRE(after->generation > before->generation);
+    REQUIRE(before->items.size() == 1);
+
+    // Listing while another thread keeps adding files never sees a torn index
+    std::atomic<bool> done{false};
+    std::atomic<int> failures{0};
+
+    std::thread writer([&] {
+        for (int i = 0; i < 40; i++) {
+            std::string name = "IMPORT" + std::to_string(i) + ".SND";
+            dir->addFile(name);
+        }
+
+        done = true;
+    });
+
+    std::size_t lastSize = 0;
+
+    while (!done) {
+        auto snapshot = dir->getSnapshot();
+        auto &items = snapshot->items;
+
+        if (items.size() < lastSize) failures++;
+
+        if (!std::is_sorted(begin(items), end(items), [](auto &a, auto &b) {
+            return AkaiStrUtil::to_lower_copy(a.name) < AkaiStrUtil::to_lower_copy(b.name);
+        }))
+            failures++;
+
+        lastSize = items.size();
+    }
+
+    writer.join();
+
+    REQUIRE(failures == 0);
+    REQUIRE(dir->getSnapshot()->items.size() == 42);
+}
+
+TEST_CASE_METHOD(AkaiFatTestsFixture, "AkaiFatLfnDirectory object cache", "[directory]")
+{
+    std::vector<std::string> names;
+
+    for (int i = 0; i < 20; i++) {
+        names.push_back("DIR" + std::to_string(i));
+        root->addDirectory(names.back());
+    }
+
+    close();
+    init(false);
+
+    fs->setCacheMemoryLimit(1);
+
+    auto getDirectory = [&](std::string &name) {
+        return std::dynamic_pointer_cast<AkaiFatLfnDirectory>(root->getEntry(name)->getDirectory());
+    };
+
+    std::vector<std::weak_ptr<AkaiFatLfnDirectory>> loaded;
+
+    for (auto &name : names)
+        loaded.push_back(getDirectory(name));
+
+    auto held = getDirectory(names[0]);
+
+    // Changed and then dropped by the caller, so it is written back before it goes
+    std::string fileName = "KEPT.SND";
+    getDirectory(names[1])->addFile(fileName);
+
+    // Loaded objects are found again while callers hold them
+    REQUIRE(getDirectory(names[0]) == held);
+
+    const auto usageBefore = fs->getMemoryUsage();
+    fs->trimCaches();
+
+    REQUIRE(fs->getMemoryUsage() < usageBefore);
+    REQUIRE(getDirectory(names[0]) == held);
+
+    for (size_t i = 1; i < names.size(); i++)
+        REQUIRE(loaded[i].expired());
+
+    REQUIRE(getDirectory(names[1])->getEntry(fileName));
+
+    close();
+    init(false);
+
+    REQUIRE(getDirectory(names[1])->getEntry(fileName));
+}
+
+TEST_CASE_METHOD(AkaiFatTestsFixture, "AkaiFatLfnDirectory::removeTree", "[directory]")
+{
+    const auto freeBefore = fs->getFreeSpace();
+
+    std::string programsName = "PROGRAMS";
+    std::string kitName = "KIT_01";
+    root->addDirectory(programsName);
+    auto programs = std::dynamic_pointer_cast<AkaiFatLfnDirectory>(root->getEntry(programsName)->getDirectory());
+    programs->addDirectory(kitName);
+    auto kit = std::dynamic_pointer_cast<AkaiFatLfnDirectory>(programs->getEntry(kitName)->getDirectory());
+
+    for (int i = 0; i < 5; i++) {
+        std::string name = "PAD_" + std::to_string(i) + ".SND";
+        auto file = kit->addFile(name)->getFile();
+        ByteBuffer src(10000);
+        file->write(0, src);
+    }
+
+    std::string programName = "KIT.PGM";
+    programs->addFile(programName)->getFile()->setLength(3000);
+
+    REQUIRE(fs->getFreeSpace() < freeBefore);
+
+    root->removeTree(programsName);
+
+    REQUIRE(!root->getEntry(programsName));
+    REQUIRE(fs->getFreeSpace() == freeBefore);
+
+    close();
+    init(false);
+
+    REQUIRE(!root->getEntry(programsName));
+    REQUIRE(fs->getFreeSpace() == freeBefore);
+}
+
+TEST_CASE_METHOD(AkaiFatTestsFixture, "AkaiFatDirectoryWalker", "[directory]")
+{
+    std::string samplesName = "SAMPLES";
+    std::string kicksName = "KICKS";
+    std::string snaresName = "SNARES";
+    std::string songName = "SONG.SEQ";
+
+    root->addDirectory(samplesName);
+    root->addFile(songName);
+    auto samples = std::dynamic_pointer_cast<AkaiFatLfnDirectory>(root->getEntry(samplesName)->getDirectory());
+    samples->addDirectory(kicksName);
+    samples->addDirectory(snaresName);
+    auto kicks = std::dynamic_pointer_cast<AkaiFatLfnDirectory>(samples->getEntry(kicksName)->getDirectory());
+    std::vector<std::string> kickNames{"KICK01.SND", "KICK02.SND"};
+    kicks->addFiles(kickNames);
+
+    for (std::size_t threadCount : {0, 2}) {
+        close();
+        init(false);
+
+        std::vector<std::string> events;
+
+        AkaiFatDirectoryWalker walker;
+        walker.setThreadCount(threadCount);
+        walker.setFilter([](const AkaiFatDirectoryWalker::Entry &, const std::string &path) {
+            return path != "SAMPLES/SNARES";
+        });
+        walker.setPreVisitor([&](const AkaiFatDirectoryWalker::Entry &, const std::string &path, std::int32_t depth) {
+            events.push_back("pre " + path + " " + std::to_string(depth));
+            return true;
+        });
+        walker.setPostVisitor([&](const AkaiFatDirectoryWalker::Entry &, const std::string &path, std::int32_t) {
+            events.push_back("post " + path);
+        });
+
+        walker.walk(root);
+
+        std::vector<std::string> expected{
+                "pre SAMPLES 0",
+                "pre SAMPLES/KICKS 1",
+                "pre SAMPLES/KICKS/KICK01.SND 2",
+                "post SAMPLES/KICKS/KICK01.SND",
+                "pre SAMPLES/KICKS/KICK02.SND 2",
+                "post SAMPLES/KICKS/KICK02.SND",
+                "post SAMPLES/KICKS",
+                "post SAMPLES",
+                "pre SONG.SEQ 0",
+                "post SONG.SEQ"
+        };
+
+        REQUIRE(events == expected);
+    }
+
+    // Subdirectories the pre-visitor skips are not read
+    close();
+    init(false);
+
+    auto &stats = fs->stats();
+    stats.setEnabled(true);
+
+    AkaiFatDirectoryWalker skipping;
+    skipping.setPreVisitor([](const AkaiFatDirectoryWalker::Entry &, const std::string &, std::int32_t) {
+        return false;
+    });
+    skipping.walk(root);
+
+    REQUIRE(stats.deviceReads.get() == 0);
+    stats.setEnabled(false);
+}
+
+TEST_CASE_METHOD(AkaiFatTestsFixture, "AkaiFatFileSystem::resolve", "[directory]")
+{
+    std::string samplesName = "SAMPLES";
+    std::string kicksName = "KICKS";
+    std::string kickName = "KICK01.SND";
+
+    root->addDirectory(samplesName);
+    auto samples = std::dynamic_pointer_cast<AkaiFatLfnDirectory>(root->getEntry(samplesName)->getDirectory());
+    samples->addDirectory(kicksName);
+    auto kicks = std::dynamic_pointer_cast<AkaiFatLfnDirectory>(samples->getEntry(kicksName)->getDirectory());
+
+    REQUIRE(!fs->resolve("SAMPLES/KICKS/KICK01.SND"));
+
+    kicks->addFile(kickName);
+
+    auto kick = fs->resolve("samples/kicks/kick01.snd");
+    REQUIRE(kick);
+    REQUIRE(kick->getName() == kickName);
+    REQUIRE(fs->resolve("SAMPLES\\KICKS\\KICK01.SND") == kick);
+    REQUIRE(fs->resolve("/SAMPLES/KICKS/") == fs->resolve("SAMPLES/KICKS"));
+    REQUIRE(!fs->resolve("SAMPLES/KICKS/KICK01.SND/FOO"));
+
+    std::string renamed = "KICK02.SND";
+    kick->setName(renamed);
+
+    REQUIRE(!fs->resolve("SAMPLES/KICKS/KICK01.SND"));
+    REQUIRE(fs->resolve("SAMPLES/KICKS/KICK02.SND") == kick);
+
+    kick->moveTo(samples, kickName);
+
+    REQUIRE(!fs->resolve("SAMPLES/KICKS/KICK02.SND"));
+    REQUIRE(fs->resolve("SAMPLES/KICK01.SND") == kick);
+
+    root->removeTree(samplesName);
+
+    REQUIRE(!fs->resolve("SAMPLES/KICK01.SND"));
+    REQUIRE(!fs->resolve("SAMPLES/KICKS"));
+}
+
+#if defined (__linux__) || defined (__APPLE__)
+TEST_CASE_METHOD(AkaiFatTestsFixture, "MetadataSidecar", "[directory]")
+{
+    std::string samplesName = "SAMPLES";
+    std::string kickName = "KICK01.SND";
+    std::string snareName = "SNARE.SND";
+    const std::string imagePath = "tmpakaifat.img";
+    const std::string sidecarPath = "tmpakaifat.img.meta";
+
+    root->addDirectory(samplesName);
+    auto samples = std::dynamic_pointer_cast<AkaiFatLfnDirectory>(root->getEntry(samplesName)->getDirectory());
+    auto kick = samples->addFile(kickName)->getFile();
+    kick->write(0, "kick", 4);
+
+    close();
+    init(false);
+
+    std::remove(sidecarPath.c_str());
+    REQUIRE(!MetadataSidecar::open(device, imagePath, sidecarPath));
+
+    MetadataSidecar::write(*fs, imagePath, sidecarPath);
+
+    {
+        auto image = std::make_shared<MappedImageBlockDevice>(imagePath, true);
+        auto cached = MetadataSidecar::open(image, imagePath, sidecarPath, true);
+        REQUIRE(cached);
+        REQUIRE(cached->isReadOnly());
+
+        AkaiFatFileSystem readOnlyFs(cached, true);
+        auto entry = readOnlyFs.resolve("SAMPLES/KICK01.SND");
+        REQUIRE(entry);
+
+        std::string data(4, ' ');
+        entry->getFile()->read(0, data.data(), 4);
+        REQUIRE(data == "kick");
+    }
+
+    samples = std::dynamic_pointer_cast<AkaiFatLfnDirectory>(root->getEntry(samplesName)->getDirectory());
+    samples->addFile(snareName)->getFile()->write(0, "snare", 5);
+    close();
+    init(false);
+
+    auto image = std::make_shared<MappedImageBlockDevice>(imagePath, true);
+    REQUIRE(!MetadataSidecar::open(image, imagePath, sidecarPath, true));
+
+    // A sidecar that cannot be written does not fail the mount
+    auto mounted = MetadataSidecar::mount(image, imagePath, "missing/tmpakaifat.img.meta");
+    REQUIRE(mounted);
+    REQUIRE(mounted->resolve("SAMPLES/SNARE.SND"));
+
+    std::remove(sidecarPath.c_str());
+}
+#endif
@@ -45,4 +45,25 @@ TEST_CASE_METHOD(AkaiFatTestsFixture, "Fat::hashCode", "[fat]")
 
     const auto onedirRemovedFatHashCode = root->getFat()->hashCode();
     REQUIRE(onedirRemovedFatHashCode == emptyFatHashCode1);
-}
\ No newline at end of file
+}
+
+TEST_CASE("ShortName::canConvert agrees with ShortName::get", "[fat]")
+{
+    std::vector<std::string> names{
+            "A", "KICK.SND", "KICK01.SND", "LONGNAME.SND", "TOOLONGNAME.SND", "KICK.SNDX", ".", "..",
+            "A.B.C", "KICK+1.SND", " KICK.SND", "", ".SND", "kick.snd", std::string("K") + (char) 0xe9 + ".SND"
+    };
+
+    for (auto& name : names) {
+        bool converted = true;
+
+        try {
+            ShortName::get(name);
+        } catch (const std::exception&) {
+            converted = false;
+        }
+
+        INFO(name);
+        REQUIRE(ShortName::canConvert(name) == converted);
+    }
+}
@@ -0,0 +1,1098 @@
+#include "catch2/catch_test_macros.hpp"
+
+#include "test.hpp"
+
+#include "fat/AkaiFatLfnDirectoryEntry.hpp"
+#include "fat/FatFileAppender.hpp"
+#include "fat/FatFileAwaitable.hpp"
+#include "fat/BatchReader.hpp"
+#include "fat/StreamingReader.hpp"
+#include "fat/FileTransfer.hpp"
+#include "fat/BackgroundFlusher.hpp"
+#include "fat/VolumeManager.hpp"
+#include "util/Trace.hpp"
+#include "AccountingBlockDevice.hpp"
+#include "MappedImageBlockDevice.hpp"
+#include "ImageBlockDevice.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <thread>
+#include <iterator>
+#include <sstream>
+#include <vector>
+
+using namespace akaifat;
+using namespace akaifat::fat;
+
+TEST_CASE_METHOD(AkaiFatTestsFixture, "FatFile pointer read and write", "[file]")
+{
+    std::string fileName = "POINTER.BIN";
+    auto file = root->addFile(fileName)->getFile();
+
+    const std::int64_t length = 3 * 2048 + 700;
+    std::vector<char> data(length);
+
+    for (std::int64_t i = 0; i < length; i++)
+        data[i] = static_cast<char>(i * 7 + 3);
+
+    // Unaligned head, several whole clusters and an unaligned tail
+    file->write(0, data.data(), 100);
+    file->write(100, data.data() + 100, length - 100);
+
+    close();
+    init(false);
+
+    file = root->getEntry(fileName)->getFile();
+    REQUIRE(file->getLength() == length);
+
+    std::vector<char> readBack(length);
+    file->read(0, readBack.data(), length);
+    REQUIRE(readBack == data);
+
+    std::vector<char> slice(2048 + 11);
+    file->read(511, slice.data(), slice.size());
+    REQUIRE(std::equal(begin(slice), end(slice), begin(data) + 511));
+
+    ByteBuffer bb(300);
+    file->read(2000, bb);
+    REQUIRE(bb.remaining() == 0);
+    REQUIRE(std::equal(begin(bb.getBuffer()), end(bb.getBuffer()), begin(data) + 2000));
+
+    // Overwrite inside a sector, the bytes around it must survive
+    char patch[3] = {'a', 'b', 'c'};
+    file->write(1025, patch, 3);
+    std::copy(patch, patch + 3, begin(data) + 1025);
+
+    file->read(0, readBack.data(), length);
+    REQUIRE(readBack == data);
+}
+
+TEST_CASE_METHOD(AkaiFatTestsFixture, "FatFile input stream", "[file]")
+{
+    std::string fileName = "LINES.TXT";
+    auto file = root->addFile(fileName)->getFile();
+
+    std::string text;
+
+    for (int i = 0; i < 500; i++)
+        text += "line " + std::to_string(i) + "\n";
+
+    file->write(0, text.data(), text.size());
+
+    auto fatFile = std::dynamic_pointer_cast<FatFile>(file);
+    auto in = fatFile->getInputStream();
+
+    std::string line;
+    int lineCount = 0;
+
+    while (std::getline(*in, line)) {
+        REQUIRE(line == "line " + std::to_string(lineCount));
+        lineCount++;
+    }
+
+    REQUIRE(lineCount == 500);
+    REQUIRE(in->eof());
+
+    in->clear();
+    in->seekg(5);
+    int number = -1;
+    *in >> number;
+    REQUIRE(number == 0);
+
+    in->seekg(-4, std::ios_base::end);
+    REQUIRE(in->get() == '4');
+    REQUIRE(in->tellg() == static_cast<std::streamoff>(text.size() - 3));
+
+    // A read spanning several clusters bypasses the buffer
+    std::vector<char> all(text.size());
+    in->seekg(0);
+    in->read(all.data(), all.size());
+    REQUIRE(in->gcount() == static_cast<std::streamsize>(text.size()));
+    REQUIRE(std::string(begin(all), end(all)) == text);
+
+    REQUIRE(in->get() == std::char_traits<char>::eof());
+
+    // A short read from an unaligned offset that crosses a cluster boundary
+    in->clear();
+    const auto clusterSize = fatFile->getChain().getClusterSize();
+    std::vector<char> crossing(200);
+    in->seekg(clusterSize - 100);
+    in->read(crossing.data(), crossing.size());
+    REQUIRE(in->gcount() == 200);
+    REQUIRE(in->good());
+    REQUIRE(std::string(begin(crossing), end(crossing)) == text.substr(clusterSize - 100, 200));
+}
+
+TEST_CASE_METHOD(AkaiFatTestsFixture, "FatFile output stream", "[file]")
+{
+    std::string fileName = "EXPORT.TXT";
+    auto file = std::dynamic_pointer_cast<FatFile>(root->addFile(fileName)->getFile());
+
+    std::string expected;
+
+    {
+        auto out = file->getOutputStream();
+
+        *out << "header";
+        REQUIRE(file->getLength() == 0);
+
+        out->flush();
+        REQUIRE(file->getLength() == 6);
+
+        expected = "header";
+
+        for (int i = 0; i < 1000; i++) {
+            *out << i << ',';
+            expected += std::to_string(i) + ",";
+        }
+
+        std::string big(5000, 'x');
+        out->write(big.data(), big.size());
+        expected += big;
+
+        *out << "end";
+        expected += "end";
+
+        REQUIRE(out->tellp() == static_cast<std::streamoff>(expected.size()));
+        REQUIRE(out->good());
+    }
+
+    close();
+    init(false);
+
+    auto in = std::dynamic_pointer_cast<FatFile>(root->getEntry(fileName)->getFile())->getInputStream();
+    std::string actual((std::istreambuf_iterator<char>(*in)), std::istreambuf_iterator<char>());
+
+    REQUIRE(actual == expected);
+}
+
+TEST_CASE_METHOD(AkaiFatTestsFixture, "FatFileAppender", "[file]")
+{
+    std::string fileName = "APPEND.SND";
+    auto file = std::dynamic_pointer_cast<FatFile>(root->addFile(fileName)->getFile());
+    auto fat = file->getChain().getFat();
+    const auto freeBefore = fat->getFreeClusterCount();
+
+    std::vector<char> expected;
+
+    {
+        FatFileAppender appender(file);
+        appender.setBatchClusters(8);
+
+        std::vector<char> chunk(3000);
+
+        for (int i = 0; i < 40; i++) {
+            for (size_t j = 0; j < chunk.size(); j++)
+                chunk[j] = static_cast<char>(i + j);
+
+            appender.append(chunk.data(), chunk.size());
+            expected.insert(end(expected), begin(chunk), end(chunk));
+            REQUIRE(file->getLength() == static_cast<std::int64_t>(expected.size()));
+        }
+    }
+
+    const auto clusterSize = file->getChain().getClusterSize();
+    const auto usedClusters = (static_cast<std::int64_t>(expected.size()) + clusterSize - 1) / clusterSize;
+    REQUIRE(file->getChain().getChainLength() == usedClusters);
+    REQUIRE(fat->getFreeClusterCount() == freeBefore - usedClusters);
+
+    // Growing through setLength appends to the tail as well
+    file->setLength(file->getLength() + 5 * clusterSize);
+    REQUIRE(file->getChain().getChainLength() == usedClusters + 5);
+    file->setLength(static_cast<std::int64_t>(expected.size()));
+
+    close();
+    init(false);
+
+    file = std::dynamic_pointer_cast<FatFile>(root->getEntry(fileName)->getFile());
+    REQUIRE(file->getLength() == static_cast<std::int64_t>(expected.size()));
+
+    std::vector<char> actual(expected.size());
+    file->read(0, actual.data(), actual.size());
+    REQUIRE(actual == expected);
+}
+
+TEST_CASE_METHOD(AkaiFatTestsFixture, "FatFile read-ahead", "[file]")
+{
+    std::string fileName = "PREVIEW.SND";
+    auto file = std::dynamic_pointer_cast<FatFile>(root->addFile(fileName)->getFile());
+
+    std::vector<char> data(20 * 2048 + 123);
+
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = static_cast<char>(i * 13);
+
+    file->write(0, data.data(), data.size());
+
+    std::vector<char> chunk(100);
+    std::int64_t offset = 0;
+
+    while (offset < static_cast<std::int64_t>(data.size())) {
+        auto len = std::min<std::int64_t>(chunk.size(), data.size() - offset);
+        file->read(offset, chunk.data(), len);
+        REQUIRE(std::equal(begin(chunk), begin(chunk) + len, begin(data) + offset));
+        offset += len;
+
+        // Data written behind the read position must be seen by the next read
+        if (offset == 10000) {
+            chunk.assign(chunk.size(), 'w');
+            file->write(offset, chunk.data(), chunk.size());
+            std::copy(begin(chunk), end(chunk), begin(data) + offset);
+        }
+    }
+
+    // Random access after a sequential run
+    file->read(777, chunk.data(), chunk.size());
+    REQUIRE(std::equal(begin(chunk), end(chunk), begin(data) + 777));
+
+    file->setMaxReadAhead(0);
+    file->read(40000, chunk.data(), chunk.size());
+    REQUIRE(std::equal(begin(chunk), end(chunk), begin(data) + 40000));
+}
+
+TEST_CASE_METHOD(AkaiFatTestsFixture, "FatFile asynchronous I/O", "[file]")
+{
+    std::string fileName = "ASYNC.SND";
+    auto file = std::dynamic_pointer_cast<FatFile>(root->addFile(fileName)->getFile());
+
+    std::vector<char> data(10000);
+
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = static_cast<char>(i * 3);
+
+    auto written = file->writeAsync(0, data.data(), data.size());
+    written.get();
+    REQUIRE(file->getLength() == static_cast<std::int64_t>(data.size()));
+
+    std::vector<char> readBack(data.size());
+    std::promise<std::exception_ptr> done;
+
+    file->readAsync(0, readBack.data(), readBack.size(), [&](std::exception_ptr error) {
+        done.set_value(error);
+    });
+
+    REQUIRE(done.get_future().get() == nullptr);
+    REQUIRE(readBack == data);
+
+    // Errors reach the future
+    auto pastEnd = file->readAsync(data.size() - 10, readBack.data(), 100);
+    REQUIRE_THROWS(pastEnd.get());
+}
+
+#ifdef AKAIFAT_COROUTINES
+namespace {
+struct DetachedCoroutine {
+    struct promise_type {
+        DetachedCoroutine get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+// Resumes on the I/O thread, fills the I/O queue from there and keeps awaiting
+DetachedCoroutine copyInChunks(std::shared_ptr<FatFile> file, std::vector<char> &data, std::promise<void> &done) {
+    try {
+        const std::int64_t chunk = 1000;
+        auto queue = file->getChain().getFat()->getIoQueue();
+
+        for (std::int64_t offset = 0; offset < static_cast<std::int64_t>(data.size()); offset += chunk) {
+            co_await writeAwaitable(file, offset, data.data() + offset, chunk);
+
+            for (int i = 0; i < 100; i++)
+                queue->submit([] {});
+
+            std::vector<char> readBack(chunk);
+            co_await readAwaitable(file, offset, readBack.data(), chunk);
+
+            if (!std::equal(begin(readBack), end(readBack), begin(data) + offset))
+                throw std::runtime_error("read back different data");
+        }
+
+        done.set_value();
+    } catch (...) {
+        done.set_exception(std::current_exception());
+    }
+}
+}
+
+TEST_CASE_METHOD(AkaiFatTestsFixture, "FatFile coroutines", "[file]")
+{
+    std::string fileName = "CORO.SND";
+    auto file = std::dynamic_pointer_cast<FatFile>(root->addFile(fileName)->getFile());
+
+    std::vector<char> data(20000);
+
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = static_cast<char>(i * 7);
+
+    std::promise<void> done;
+    auto finished = done.get_future();
+    copyInChunks(file, data, done);
+
+    REQUIRE(finished.wait_for(std::chrono::seconds(10)) == std::future_status::ready);
+    finished.get();
+    REQUIRE(file->getLength() == static_cast<std::int64_t>(data.size()));
+}
+#endif
+
+TEST_CASE_METHOD(AkaiFatTestsFixture, "BatchReader", "[file]")
+{
+    std::vector<std::shared_ptr<FatFile>> files;
+    std::vector<std::vector<char>> contents;
+
+    // Interleaved growth fragments the chains
+    for (int i = 0; i < 4; i++) {
+        std::string name = "PAD" + std::to_string(i) + ".SND";
+        files.push_back(std::dynamic_pointer_cast<FatFile>(root->addFile(name)->getFile()));
+        contents.emplace_back();
+    }
+
+    for (int round = 0; round < 5; round++) {
+        for (size_t i = 0; i < files.size(); i++) {
+            std::vector<char> chunk(3000, static_cast<char>('a' + i * 5 + round));
+            files[i]->write(contents[i].size(), chunk.data(), chunk.size());
+            contents[i].insert(end(contents[i]), begin(chunk), end(chunk));
+        }
+    }
+
+    REQUIRE(files[0]->getChain().getExtents(0, contents[0].size()).size() > 1);
+
+    BatchReader reader;
+    std::vector<std::vector<char>> results(files.size() * 2);
+
+    for (size_t i = 0; i < files.size(); i++) {
+        results[i * 2].resize(contents[i].size());
+        reader.add(files[i], 0, contents[i].size(), results[i * 2].data());
+
+        results[i * 2 + 1].resize(1000);
+        reader.add(files[i], 5500, 1000, results[i * 2 + 1].data());
+    }
+
+    reader.execute();
+    REQUIRE(reader.size() == 0);
+
+    for (size_t i = 0; i < files.size(); i++) {
+        REQUIRE(results[i * 2] == contents[i]);
+        REQUIRE(std::equal(begin(results[i * 2 + 1]), end(results[i * 2 + 1]), begin(contents[i]) + 5500));
+    }
+
+    reader.setMaxGap(0);
+    reader.setMaxMerged(2048);
+    std::fill(begin(results[0]), end(results[0]), 0);
+    reader.add(files[0], 0, contents[0].size(), results[0].data());
+    reader.execute();
+    REQUIRE(results[0] == contents[0]);
+
+    reader.add(files[0], 1, contents[0].size(), results[0].data());
+    REQUIRE_THROWS(reader.execute());
+    REQUIRE(reader.size() == 0);
+}
+
+TEST_CASE_METHOD(AkaiFatTestsFixture, "StreamingReader", "[file]")
+{
+    std::string fileName = "STREAM.SND";
+    auto file = std::dynamic_pointer_cast<FatFile>(root->addFile(fileName)->getFile());
+
+    std::vector<char> data(100000);
+
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = static_cast<char>(i * 11);
+
+    file->write(0, data.data(), data.size());
+
+    StreamingReader reader(file, 16384, 1000);
+    reader.setPreRoll(8192);
+    reader.setLowWatermark(4096);
+    reader.start();
+    REQUIRE(reader.getBuffered() >= 8192);
+
+    std::vector<char> received;
+    char frames[256];
+
+    while (!reader.isFinished()) {
+        auto count = reader.pull(frames, sizeof(frames));
+        received.insert(end(received), frames, frames + count);
+
+        if (count == 0) std::this_thread::yield();
+    }
+
+    REQUIRE(reader.getError() == nullptr);
+    REQUIRE(received.size() == data.size() - 1000);
+    REQUIRE(std::equal(begin(received), end(received), begin(data) + 1000));
+
+    // A low watermark below the pre-roll is honoured on its own
+    StreamingReader lowReader(file, 16384);
+    lowReader.setPreRoll(8192);
+    lowReader.setLowWatermark(1024);
+    lowReader.start();
+
+    // Generous, so a slow machine does not fail the test
+    auto waitFor = [](const std::function<bool()> &condition) {
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+
+        while (!condition()) {
+            if (std::chrono::steady_clock::now() > deadline) return false;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        return true;
+    };
+
+    REQUIRE(waitFor([&] { return lowReader.getBuffered() == 16384; }));
+
+    std::vector<char> drained(16384);
+    REQUIRE(lowReader.pull(drained.data(), 12288) == 12288);
+
+    // Nothing is refilled above the watermark, however long this waits
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    REQUIRE(lowReader.getBuffered() == 4096);
+
+    REQUIRE(lowReader.pull(drained.data(), 3500) == 3500);
+    REQUIRE(waitFor([&] { return lowReader.getBuffered() > 596; }));
+    lowReader.stop();
+
+    util::SpscRingBuffer<char> ring(5);
+    REQUIRE(ring.capacity() == 8);
+    REQUIRE(ring.write("abcdefghij", 10) == 8);
+    char out[8];
+    REQUIRE(ring.read(out, 3) == 3);
+    REQUIRE(ring.write("xyz", 3) == 3);
+    REQUIRE(ring.read(out, 8) == 8);
+    REQUIRE(std::string(out, 8) == "defghxyz");
+}
+
+#if defined (__linux__) || defined (__APPLE__)
+TEST_CASE_METHOD(AkaiFatTestsFixture, "FatFile views over a mapped image", "[file]")
+{
+    std::string names[3] = {"ONE.SND", "TWO.SND", "THREE.SND"};
+    auto contiguous = std::dynamic_pointer_cast<FatFile>(root->addFile(names[0])->getFile());
+    auto a = std::dynamic_pointer_cast<FatFile>(root->addFile(names[1])->getFile());
+    auto b = std::dynamic_pointer_cast<FatFile>(root->addFile(names[2])->getFile());
+
+    std::string text(5000, 'c');
+    contiguous->write(0, text.data(), text.size());
+
+    REQUIRE(contiguous->getView() == nullptr);
+
+    // Alternating growth fragments both files
+    for (int i = 0; i < 3; i++) {
+        std::string chunk(2048, static_cast<char>('a' + i));
+        a->write(a->getLength(), chunk.data(), chunk.size());
+        b->write(b->getLength(), chunk.data(), chunk.size());
+    }
+
+    close();
+
+    auto mapped = std::make_shared<MappedImageBlockDevice>("tmpakaifat.img", true);
+    std::unique_ptr<AkaiFatFileSystem> mappedFs(AkaiFatFileSystem::read(mapped, true));
+    auto mappedRoot = std::dynamic_pointer_cast<AkaiFatLfnDirectory>(mappedFs->getRoot());
+
+    auto view = std::dynamic_pointer_cast<FatFile>(mappedRoot->getEntry(names[0])->getFile())->getView();
+    REQUIRE(view);
+    REQUIRE(view->isContiguous());
+    REQUIRE(std::string(view->data(), view->size()) == text);
+
+    auto fragmented = std::dynamic_pointer_cast<FatFile>(mappedRoot->getEntry(names[1])->getFile())->getView(1000, 4000);
+    REQUIRE(!fragmented->isContiguous());
+    REQUIRE(fragmented->size() == 4000);
+
+    std::string joined;
+
+    for (auto& span : fragmented->getSpans())
+        joined.append(span.data, span.size);
+
+    REQUIRE(joined == std::string(1048, 'a') + std::string(2048, 'b') + std::string(904, 'c'));
+
+    // Views keep the image mapped after the mount and the device are gone
+    mappedFs->close();
+    mappedFs.reset();
+    mapped->close();
+    REQUIRE(mapped->isClosed());
+    REQUIRE(std::string(view->data(), view->size()) == text);
+
+    view.reset();
+    fragmented.reset();
+
+    init(false);
+}
+#endif
+
+TEST_CASE_METHOD(AkaiFatTestsFixture, "Concurrent readers share a mount", "[file]")
+{
+    std::string dirName = "SHARED";
+    root->addDirectory(dirName);
+    auto dir = std::dynamic_pointer_cast<AkaiFatLfnDirectory>(root->getEntry(dirName)->getDirectory());
+
+    const int fileCount = 4;
+    std::vector<std::string> contents;
+
+    for (int i = 0; i < fileCount; i++) {
+        std::string name = "FILE" + std::to_string(i) + ".SND";
+        auto file = dir->addFile(name)->getFile();
+        contents.emplace_back(9000 + i * 1000, static_cast<char>('k' + i));
+        file->write(0, contents.back().data(), contents.back().size());
+    }
+
+    // Start with cold caches
+    close();
+    init(false);
+
+    std::atomic<int> failures{0};
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < 8; t++) {
+        threads.emplace_back([&, t] {
+            for (int round = 0; round < 20; round++) {
+                auto i = (t + round) % fileCount;
+                auto entry = fs->resolve("shared/file" + std::to_string(i) + ".snd");
+
+                if (!entry) {
+                    failures++;
+                    continue;
+                }
+
+                auto file = entry->getFile();
+                std::string data(file->getLength(), '\0');
+
+                for (std::int64_t offset = 0; offset < file->getLength(); offset += 700) {
+                    auto len = std::min<std::int64_t>(700, file->getLength() - offset);
+                    file->read(offset, &data[offset], len);
+                }
+
+                if (data != contents[i]) failures++;
+            }
+        });
+    }
+
+    for (auto &thread : threads)
+        thread.join();
+
+    REQUIRE(failures == 0);
+}
+
+TEST_CASE_METHOD(AkaiFatTestsFixture, "Concurrent writers in separate directories", "[file]")
+{
+    const int dirCount = 4;
+    const int filesPerDir = 6;
+    std::vector<std::shared_ptr<AkaiFatLfnDirectory>> dirs;
+
+    for (int d = 0; d < dirCount; d++) {
+        std::string dirName = "WRITER" + std::to_string(d);
+        root->addDirectory(dirName);
+        dirs.push_back(std::dynamic_pointer_cast<AkaiFatLfnDirectory>(root->getEntry(dirName)->getDirectory()));
+    }
+
+    const auto freeBefore = fs->getFreeSpace();
+
+    auto contentOf = [](int d, int f) {
+        return std::string(3000 + d * 1500 + f * 700, static_cast<char>('a' + d * filesPerDir + f));
+    };
+
+    std::atomic<int> failures{0};
+    std::vector<std::thread> threads;
+
+    for (int d = 0; d < dirCount; d++) {
+        threads.emplace_back([&, d] {
+            try {
+                for (int f = 0; f < filesPerDir; f++) {
+                    std::string name = "FILE" + std::to_string(f) + ".SND";
+                    auto file = dirs[d]->addFile(name)->getFile();
+                    auto content = contentOf(d, f);
+
+                    // Grow in steps, so the chains of all threads are extended concurrently
+                    for (std::size_t offset = 0; offset < content.size(); offset += 1000)
+                        file->write(offset, content.data() + offset, std::min<std::size_t>(1000, content.size() - offset));
+                }
+            } catch (const std::exception &) {
+                failures++;
+            }
+        });
+    }
+
+    for (auto &thread : threads)
+        thread.join();
+
+    REQUIRE(failures == 0);
+    REQUIRE(fs->getFreeSpace() < freeBefore);
+
+    close();
+    init(false);
+
+    for (int d = 0; d < dirCount; d++) {
+        for (int f = 0; f < filesPerDir; f++) {
+            auto entry = fs->resolve("writer" + std::to_string(d) + "/file" + std::to_string(f) + ".snd");
+            REQUIRE(entry);
+
+            auto file = entry->getFile();
+            auto expected = contentOf(d, f);
+            std::string data(file->getLength(), '\0');
+            file->read(0, data.data(), data.size());
+
+            REQUIRE(data == expected);
+        }
+    }
+}
+
+TEST_CASE_METHOD(AkaiFatTestsFixture, "Removing a file while it is written", "[file]")
+{
+    std::string dirName = "D";
+    root->addDirectory(dirName);
+    auto dir = std::dynamic_pointer_cast<AkaiFatLfnDirectory>(root->getEntry(dirName)->getDirectory());
+
+    std::string writtenName = "A.SND";
+    std::string keptName = "B.SND";
+    auto file = dir->addFile(writtenName)->getFile();
+    std::string kept(20000, 'k');
+    dir->addFile(keptName)->getFile()->write(0, kept.data(), kept.size());
+
+    std::atomic<int> failures{0};
+    std::atomic<int> written{0};
+
+    std::thread writer([&] {
+        try {
+            std::string chunk(1000, 'w');
+
+            // Grow in steps, so the chain is extended while it is being freed
+            for (int i = 0; i < 60; i++) {
+                file->write(i * 1000, chunk.data(), chunk.size());
+                written++;
+            }
+        } catch (const std::exception &) {
+            failures++;
+        }
+    });
+
+    while (written < 10) std::this_thread::yield();
+
+    dir->remove(writtenName);
+    writer.join();
+
+    REQUIRE(failures == 0);
+    REQUIRE(!dir->getEntry(writtenName));
+
+    close();
+    init(false);
+
+    // The clusters freed by remove() were not written to behind the back of B.SND
+    auto entry = fs->resolve("d/b.snd");
+    REQUIRE(entry);
+    std::string data(entry->getFile()->getLength(), '\0');
+    entry->getFile()->read(0, data.data(), data.size());
+    REQUIRE(data == kept);
+    REQUIRE(!fs->resolve("d/a.snd"));
+}
+
+TEST_CASE_METHOD(AkaiFatTestsFixture, "Writing a file while its directory changes", "[file]")
+{
+    std::string dirName = "D";
+    root->addDirectory(dirName);
+    auto dir = std::dynamic_pointer_cast<AkaiFatLfnDirectory>(root->getEntry(dirName)->getDirectory());
+
+    std::string writtenName = "A.SND";
+    auto file = dir->addFile(writtenName)->getFile();
+    std::string content(40000, 'w');
+    std::atomic<int> failures{0};
+
+    // Adding entries rewrites the entry of A.SND while its length grows
+    std::thread writer([&] {
+        try {
+            for (std::size_t offset = 0; offset < content.size(); offset += 1000)
+                file->write(offset, content.data() + offset, 1000);
+        } catch (const std::exception &) {
+            failures++;
+        }
+    });
+
+    for (int i = 0; i < 10; i++) {
+        std::string name = "B" + std::to_string(i) + ".SND";
+        dir->addFile(name);
+    }
+
+    writer.join();
+
+    REQUIRE(failures == 0);
+
+    close();
+    init(false);
+
+    auto entry = fs->resolve("d/a.snd");
+    REQUIRE(entry);
+    std::string data(entry->getFile()->getLength(), '\0');
+    entry->getFile()->read(0, data.data(), data.size());
+    REQUIRE(data == content);
+}
+
+TEST_CASE_METHOD(AkaiFatTestsFixture, "BackgroundFlusher", "[file]")
+{
+    REQUIRE(device->canSync());
+
+    BackgroundFlusher flusher(fs);
+    flusher.setDurability(BackgroundFlusher::Durability::GroupCommit);
+    flusher.setMaxDirtyAge(std::chrono::milliseconds(50));
+    flusher.start();
+
+    std::string name = "AGED.SND";
+    auto file = root->addFile(name)->getFile();
+    std::string content(10000, 'f');
+    file->write(0, content.data(), content.size());
+
+    // The dirty age alone gets it flushed. The count goes up once the sync is done too.
+    for (int i = 0; i < 200 && (fs->getDirtyBytes() > 0 || flusher.getFlushCount() == 0); i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    REQUIRE(fs->getDirtyBytes() == 0);
+    REQUIRE(flusher.getFlushCount() >= 1);
+
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&, t] {
+            std::string committedName = "COMMIT" + std::to_string(t) + ".SND";
+            auto committedFile = root->addFile(committedName)->getFile();
+            std::string data(3000, static_cast<char>('p' + t));
+            committedFile->write(0, data.data(), data.size());
+            flusher.commit();
+        });
+    }
+
+    for (auto &thread : threads)
+        thread.join();
+
+    REQUIRE(!flusher.getError());
+
+    // Committed changes are on the image without flushing this mount
+    std::fstream img("tmpakaifat.img", std::ios_base::in | std::ios_base::binary);
+    AkaiFatFileSystem other(std::make_shared<ImageBlockDevice>(img), true);
+
+    for (int t = 0; t < 4; t++) {
+        auto entry = other.resolve("commit" + std::to_string(t) + ".snd");
+        REQUIRE(entry);
+
+        auto otherFile = entry->getFile();
+        std::string data(otherFile->getLength(), '\0');
+        otherFile->read(0, data.data(), data.size());
+
+        REQUIRE(data == std::string(3000, static_cast<char>('p' + t)));
+    }
+
+    REQUIRE(flusher.getSyncCount() >= 1);
+    flusher.stop();
+
+    // Without a descriptor to sync, a flush that should be durable reports an error
+    std::fstream plainImg("tmpakaifat.img", std::ios_base::in | std::ios_base::out | std::ios_base::binary);
+    AkaiFatFileSystem plain(std::make_shared<ImageBlockDevice>(plainImg), false);
+    BackgroundFlusher unsynced(&plain);
+    unsynced.start();
+
+    REQUIRE_THROWS(unsynced.commit());
+    REQUIRE(unsynced.getSyncCount() == 0);
+
+    unsynced.setDurability(BackgroundFlusher::Durability::NoSync);
+    unsynced.commit();
+    REQUIRE(!unsynced.getError());
+    unsynced.stop();
+}
+
+#if defined (__linux__) || defined (__APPLE__)
+TEST_CASE_METHOD(AkaiFatTestsFixture, "VolumeManager", "[file]")
+{
+    close();
+
+    const std::string otherImage = "tmpakaifat2.img";
+    std::filesystem::copy_file("tmpakaifat.img", otherImage, std::filesystem::copy_options::overwrite_existing);
+
+    {
+        VolumeManager manager(64 * 1024 * 1024);
+
+        auto volume = manager.open("tmpakaifat.img", false);
+        REQUIRE(manager.open("./tmpakaifat.img", true) == volume);
+
+        std::string name = "SHARED.SND";
+        auto volumeRoot = std::dynamic_pointer_cast<AkaiFatLfnDirectory>(volume->getRoot());
+        volumeRoot->addFile(name)->getFile()->write(0, "shared", 6);
+
+        REQUIRE(!manager.close("tmpakaifat.img"));
+
+        volumeRoot.reset();
+        volume.reset();
+        REQUIRE(manager.close("tmpakaifat.img"));
+        REQUIRE(manager.getOpenCount() == 0);
+
+        // Files and views obtained from a volume keep it mounted
+        volume = manager.open("tmpakaifat.img", true);
+        auto file = std::dynamic_pointer_cast<FatFile>(volume->resolve(name)->getFile());
+        auto view = file->getView();
+        volume.reset();
+
+        REQUIRE(!manager.close("tmpakaifat.img"));
+
+        // Stream buffers count towards the budget
+        const auto usage = manager.getMemoryUsage();
+        auto in = file->getInputStream();
+        REQUIRE(manager.getMemoryUsage() >= usage + file->getChain().getClusterSize());
+        in.reset();
+        file.reset();
+        manager.setMemoryBudget(1);
+        REQUIRE(manager.isOpen("tmpakaifat.img"));
+        REQUIRE(std::string(view->data(), view->size()) == "shared");
+
+        view.reset();
+        manager.trim();
+        REQUIRE(!manager.isOpen("tmpakaifat.img"));
+        manager.setMemoryBudget(64 * 1024 * 1024);
+
+        // Least recently opened idle volumes go first when the budget is exceeded
+        manager.open("tmpakaifat.img", true);
+        manager.open(otherImage, true);
+        manager.open("tmpakaifat.img", true);
+        REQUIRE(manager.getOpenCount() == 2);
+
+        manager.setMemoryBudget(manager.getMemoryUsage() - 1);
+        REQUIRE(manager.isOpen("tmpakaifat.img"));
+        REQUIRE(!manager.isOpen(otherImage));
+
+        manager.setMemoryBudget(1);
+        REQUIRE(!manager.isOpen("tmpakaifat.img"));
+
+        auto other = manager.open(otherImage, true);
+        REQUIRE(manager.isOpen(otherImage));
+        REQUIRE(manager.getMemoryUsage() > 1);
+
+        // Volumes in use stay mounted
+        manager.setMemoryBudget(64 * 1024 * 1024);
+        manager.open("tmpakaifat.img", true);
+        manager.closeAll();
+        REQUIRE(manager.isOpen(otherImage));
+        REQUIRE(!manager.isOpen("tmpakaifat.img"));
+    }
+
+    std::remove(otherImage.c_str());
+
+    init(false);
+
+    auto entry = fs->resolve("SHARED.SND");
+    REQUIRE(entry);
+
+    std::string data(6, ' ');
+    entry->getFile()->read(0, data.data(), 6);
+    REQUIRE(data == "shared");
+}
+#endif
+
+TEST_CASE_METHOD(AkaiFatTestsFixture, "AkaiFatFileSystem::stats", "[file]")
+{
+    auto &stats = fs->stats();
+    std::string name = "COUNTED.SND";
+    std::string content(5000, 'c');
+
+    root->addFile(name)->getFile()->write(0, content.data(), content.size());
+    fs->flush();
+
+    REQUIRE(stats.deviceWrites.get() == 0);
+    REQUIRE(stats.allocations.get() == 0);
+
+    stats.setEnabled(true);
+
+    auto file = fs->resolve("COUNTED.SND")->getFile();
+    REQUIRE(fs->resolve("COUNTED.SND"));
+    file->setLength(10000);
+    file->write(5000, content.data(), content.size());
+
+    std::string data(10000, ' ');
+    file->read(0, data.data(), data.size());
+    fs->flush();
+
+    REQUIRE(stats.dentryCacheMisses.get() == 1);
+    REQUIRE(stats.dentryCacheHits.get() == 1);
+    REQUIRE(stats.allocations.get() > 0);
+    REQUIRE(stats.deviceWrites.get() > 0);
+    REQUIRE(stats.deviceWriteBytes.get() >= content.size());
+    REQUIRE(stats.directoryFlushes.get() > 0);
+    REQUIRE(stats.flushLatency.getCount() == 1);
+
+    const auto json = stats.toJson();
+    REQUIRE(json.find("\"dentryCacheHits\": 1") != std::string::npos);
+    REQUIRE(json.find("\"flush\": {\"count\": 1") != std::string::npos);
+
+    stats.reset();
+    REQUIRE(stats.deviceWrites.get() == 0);
+    REQUIRE(stats.flushLatency.getCount() == 0);
+}
+
+TEST_CASE_METHOD(AkaiFatTestsFixture, "Tracing", "[file]")
+{
+    auto sink = std::make_shared<util::ChromeTraceSink>();
+    util::Trace::setSink(sink);
+
+    close();
+    init(false);
+
+    std::string name = "TRACED.SND";
+    std::string content(5000, 't');
+    root->addFile(name)->getFile()->write(0, content.data(), content.size());
+    fs->flush();
+
+    util::Trace::setSink(nullptr);
+
+    const auto eventCount = sink->getEventCount();
+    root->getEntry(name)->getFile()->write(0, content.data(), content.size());
+    REQUIRE(sink->getEventCount() == eventCount);
+
+    std::ostringstream out;
+    sink->write(out);
+    const auto json = out.str();
+
+    REQUIRE(json.rfind("{\"traceEvents\": [", 0) == 0);
+
+    for (auto traced : {"AkaiFatFileSystem::mount", "Fat::read", "AkaiFatLfnDirectory::parseLfn",
+                        "AkaiFatLfnDirectory::updateLFN", "AbstractDirectory::flush",
+                        "ClusterChain::writeData", "BlockDevice::read", "BlockDevice::write"})
+        REQUIRE(json.find("\"" + std::string(traced) + "\"") != std::string::npos);
+
+    // The mount span covers reading the boot sector
+    struct Collector : util::TraceSink {
+        std::mutex mutex;
+        std::vector<util::TraceEvent> events;
+
+        void record(const util::TraceEvent &event) override {
+            std::lock_guard<std::mutex> guard(mutex);
+            events.push_back(event);
+        }
+    };
+
+    auto collector = std::make_shared<Collector>();
+    util::Trace::setSink(collector);
+    close();
+    init(false);
+    util::Trace::setSink(nullptr);
+
+    auto &events = collector->events;
+    auto mount = std::find_if(begin(events), end(events), [](auto &e) { return std::string(e.name) == "AkaiFatFileSystem::mount"; });
+    auto bootSector = std::find_if(begin(events), end(events), [](auto &e) { return std::string(e.name) == "BlockDevice::read" && e.offset == 0; });
+
+    REQUIRE(mount != end(events));
+    REQUIRE(bootSector != end(events));
+    REQUIRE(bootSector->startNs >= mount->startNs);
+    REQUIRE(bootSector->startNs + bootSector->durationNs <= mount->startNs + mount->durationNs);
+}
+
+TEST_CASE_METHOD(AkaiFatTestsFixture, "AccountingBlockDevice", "[file]")
+{
+    close();
+
+    std::fstream img("tmpakaifat.img", std::ios_base::in | std::ios_base::out | std::ios_base::binary);
+    auto accounting = std::make_shared<AccountingBlockDevice>(std::make_shared<ImageBlockDevice>(img), 4);
+
+    // Writes back what was read, so the image stays intact
+    std::vector<char> buffer(2048);
+    accounting->read(0, buffer.data(), 1024);
+    accounting->read(1024, buffer.data() + 1024, 1024);
+    accounting->write(1000, buffer.data() + 1000, 100);
+
+    auto metrics = accounting->getMetrics();
+    REQUIRE(metrics.reads == 2);
+    REQUIRE(metrics.writes == 1);
+    REQUIRE(metrics.sequentialRequests == 1);
+    REQUIRE(metrics.unalignedRequests == 1);
+    REQUIRE(metrics.readModifyWrites == 2);
+    REQUIRE(metrics.sectorBytes == 2048 + 1024);
+    REQUIRE(metrics.getAmplification() > 1.0);
+    REQUIRE(metrics.sizeHistogram[0] == 1);
+    REQUIRE(metrics.sizeHistogram[1] == 2);
+
+    // Mounted through the accounting device, file system I/O shows up as well
+    {
+        AkaiFatFileSystem accounted(accounting, false);
+        std::string name = "ACCOUNTED.SND";
+        std::string content(3000, 'a');
+        auto accountedRoot = std::dynamic_pointer_cast<AkaiFatLfnDirectory>(accounted.getRoot());
+        accountedRoot->addFile(name)->getFile()->write(0, content.data(), content.size());
+        accounted.flush();
+    }
+
+    REQUIRE(accounting->getMetrics().writes > metrics.writes);
+
+    auto recent = accounting->getRecentRequests();
+    REQUIRE(recent.size() == 4);
+    REQUIRE(recent.back().direction == AccountingBlockDevice::Direction::Write);
+
+    accounting->reset();
+    REQUIRE(accounting->getMetrics().getRequestCount() == 0);
+    REQUIRE(accounting->getRecentRequests().empty());
+
+    img.close();
+    init(false);
+}
+
+static std::string readHostFile(const std::string& path)
+{
+    std::ifstream in(path, std::ios_base::binary);
+    return std::string((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+}
+
+TEST_CASE_METHOD(AkaiFatTestsFixture, "FileTransfer export and import", "[file]")
+{
+    std::string names[2] = {"EXPORT.SND", "IMPORT.SND"};
+    auto file = std::dynamic_pointer_cast<FatFile>(root->addFile(names[0])->getFile());
+    root->addFile(names[1]);
+
+    std::string content;
+
+    for (int i = 0; i < 3000; i++)
+        content += std::to_string(i) + ";";
+
+    file->write(0, content.data(), content.size());
+
+    // ImageBlockDevice has no descriptor, so this goes through the buffered path
+    FileTransfer::exportFile(file, "tmpexport.bin");
+    REQUIRE(readHostFile("tmpexport.bin") == content);
+
+    auto imported = std::dynamic_pointer_cast<FatFile>(root->getEntry(names[1])->getFile());
+    FileTransfer::importFile("tmpexport.bin", imported);
+    REQUIRE(imported->getLength() == static_cast<std::int64_t>(content.size()));
+
+#if defined (__linux__)
+    close();
+
+    {
+        auto mapped = std::make_shared<MappedImageBlockDevice>("tmpakaifat.img");
+        std::unique_ptr<AkaiFatFileSystem> mappedFs(AkaiFatFileSystem::read(mapped, false));
+        auto mappedRoot = std::dynamic_pointer_cast<AkaiFatLfnDirectory>(mappedFs->getRoot());
+
+        auto mappedFile = std::dynamic_pointer_cast<FatFile>(mappedRoot->getEntry(names[1])->getFile());
+        FileTransfer::exportFile(mappedFile, "tmpexport2.bin");
+        REQUIRE(readHostFile("tmpexport2.bin") == content);
+
+        {
+            std::ofstream out("tmpexport2.bin", std::ios_base::binary | std::ios_base::trunc);
+            out << content << content;
+        }
+
+        FileTransfer::importFile("tmpexport2.bin", mappedFile);
+        REQUIRE(mappedFile->getLength() == static_cast<std::int64_t>(content.size() * 2));
+
+        std::string readBack(content.size() * 2, '\0');
+        mappedFile->read(0, &readBack[0], readBack.size());
+        REQUIRE(readBack == content + content);
+
+        mappedFs->flush();
+        mappedFs->close();
+    }
+
+    init(false);
+    auto reread = std::dynamic_pointer_cast<FatFile>(root->getEntry(names[1])->getFile());
+    REQUIRE(reread->getLength() == static_cast<std::int64_t>(content.size() * 2));
+    std::remove("tmpexport2.bin");
+#endif
+
+    std::remove("tmpexport.bin");
+}
@@ -137,7 +137,7 @@ void AkaiFatTestsFixture::init(bool create) {
 
     img.seekg(std::ios::beg);
 
-    device = std::make_shared<ImageBlockDevice>(img, IMAGE_SIZE);
+    device = std::make_shared<ImageBlockDevice>(img, IMAGE_SIZE, IMAGE_NAME);
     fs = dynamic_cast<AkaiFatFileSystem *>(FileSystemFactory::createAkai(device, false));
 
     root = std::dynamic_pointer_cast<AkaiFatLfnDirectory>(fs->getRoot());